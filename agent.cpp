@@ -1,7 +1,10 @@
 #include "agent.hpp"
 
 #include <cassert>
+#include <cstdio>
+#include <cstring>
 
+#include "checkpoint.hpp"
 #include "predict.hpp"
 #include "search.hpp"
 #include "util.hpp"
@@ -14,6 +17,8 @@ Agent::Agent(options_t & options) {
 	strExtract(options["agent-actions"], m_actions);
 	strExtract(options["agent-horizon"], m_horizon);
 	strExtract(options["mc-simulations"], m_simulations);
+	m_search_time = strExtract<double>(options["search-time-ms"]) / 1000.0;
+	if (m_search_time < 0.0) m_search_time = 0.0;
 	strExtract(options["observation-bits"], m_obs_bits);
 	strExtract<unsigned int>(options["reward-bits"], m_rew_bits);
 
@@ -22,19 +27,65 @@ Agent::Agent(options_t & options) {
 		m_actions_bits = c;
 	}
 
-	m_ct = new ContextTree(strExtract<unsigned int>(options["ct-depth"]));
+	// select the context tree node layout
+	NodeFormat format = StandardNodes;
+	if (options["ct-node-format"] == "compact") {
+		format = CompactNodes;
+	} else if (options["ct-node-format"] == "hashed") {
+		format = HashedNodes;
+	} else if (options["ct-node-format"] != "standard") {
+		std::cerr << "WARNING: unknown ct-node-format '" << options["ct-node-format"]
+			<< "', using standard" << std::endl;
+	}
+
+	// optionally give every percept bit its own context tree, updated on
+	// ct-threads threads
+	size_t factors = 1;
+	if (options["ct-factored"] == "true") {
+		factors = m_obs_bits + m_rew_bits;
+	} else if (options["ct-factored"] != "false") {
+		std::cerr << "WARNING: unknown ct-factored '" << options["ct-factored"]
+			<< "', using false" << std::endl;
+	}
+	size_t threads = strExtract<unsigned int>(options["ct-threads"]);
+	if (threads < 1) threads = 1;
+
+	m_ct = new FactoredContextTree(strExtract<unsigned int>(options["ct-depth"]),
+		format, factors, threads);
+
+	// bound the memory the model may use
+	m_ct->setMaxNodes(strExtract<size_t>(options["ct-max-nodes"]));
+
+	// defer weighting the context tree until a prediction needs it
+	if (options["ct-lazy-weights"] == "true") {
+		m_ct->setLazyWeights(true);
+	} else if (options["ct-lazy-weights"] != "false") {
+		std::cerr << "WARNING: unknown ct-lazy-weights '" << options["ct-lazy-weights"]
+			<< "', using false" << std::endl;
+	}
+
+	// keep enough history resident to revert a whole simulation
+	m_ct->setHistoryWindow(m_horizon * (m_actions_bits + m_obs_bits + m_rew_bits));
 
 	reset();
 }
 
-Agent::Agent(const Agent &a) {
+Agent::Agent(const Agent &a, TreeCopy copy) {
 	m_actions = a.m_actions;
 	m_horizon = a.m_horizon;
 	m_simulations = a.m_simulations;
+	m_search_time = a.m_search_time;
 	m_obs_bits = a.m_obs_bits;
 	m_rew_bits = a.m_rew_bits;
 	m_actions_bits = a.m_actions_bits;
-	m_ct = new ContextTree(*a.m_ct);
+	m_ct = new FactoredContextTree(*a.m_ct, copy);
+	m_time_cycle = a.m_time_cycle;
+	m_cycle = a.m_cycle;
+	m_explore_rate = a.m_explore_rate;
+	m_total_reward = a.m_total_reward;
+	m_last_update_percept = a.m_last_update_percept;
+	m_last_action = a.m_last_action;
+	m_last_observation = a.m_last_observation;
 }
 
 
@@ -63,6 +114,12 @@ age_t Agent::age(void) const {
 	return m_time_cycle;
 }
 
+// record the main loop's progress, for the next checkpoint
+void Agent::setCycle(unsigned int cycle, double explore_rate) {
+	m_cycle = cycle;
+	m_explore_rate = explore_rate;
+}
+
 // the total accumulated reward across an agents lifespan
 reward_t Agent::reward(void) const {
 	return m_total_reward;
@@ -104,6 +161,18 @@ size_t Agent::horizon(void) const {
 }
 
 
+// the size and activity of the agent's model
+void Agent::modelStats(CTStats &stats) const {
+	m_ct->stats(stats);
+}
+
+
+// recompute any weights the model has deferred
+void Agent::refreshModel(void) {
+	m_ct->refreshWeights();
+}
+
+
 
 // generate an action uniformly at random
 action_t Agent::genRandomAction(void) const {
@@ -154,6 +223,25 @@ void Agent::genPerceptAndUpdate(percept_t *observation, percept_t *reward) {
 }
 
 
+// update the model with bits [from, to) of a percept being generated
+void Agent::modelUpdatePercept(const symbol_list_t &percept, size_t from, size_t to) {
+	for (size_t i = from; i < to; i++) m_ct->updateBit(i, percept[i]);
+
+	if (to == perceptBits()) {
+		m_total_reward += decodeReward(percept);
+		m_last_update_percept = true;
+	}
+}
+
+// the observation and reward a percept's bits stand for
+void Agent::decodePercept(const symbol_list_t &percept, percept_t *observation, percept_t *reward) const {
+	*reward = decodeReward(percept);
+	// the observation's bits come first, see encodePercept
+	symbol_list_t obs(percept.begin(), percept.begin() + m_obs_bits);
+	*observation = decodeObservation(obs);
+}
+
+
 // Update the agent's internal model of the world after receiving a percept
 void Agent::modelUpdate(percept_t observation, percept_t reward) {
 	// Update internal model
@@ -167,6 +255,7 @@ void Agent::modelUpdate(percept_t observation, percept_t reward) {
 	// Update other properties
 	m_total_reward += reward;
 	m_last_update_percept = true;
+	m_last_observation = observation;
 }
 
 
@@ -183,42 +272,27 @@ void Agent::modelUpdate(action_t action) {
 
 	m_time_cycle++;
 	m_last_update_percept = false;
+	m_last_action = action;
 }
 
 
 // revert the agent's internal model of the world
 // to that of a previous time cycle, false on failure
 bool Agent::modelRevert(const ModelUndo &mu) {
-	
-	// correct asserts
-	try {
-	assert(mu.age() <= age());
-	assert(mu.historySize() <= historySize());
-	}
-	catch (char *str) {
-	return false;
+	// the save point must belong to this agent and lie in its past
+	if (&mu.agent() != this || mu.age() > age() || mu.historySize() > historySize()) {
+		return false;
 	}
 
-	// remove all new items from the historySize
-	// revert the CTW at each step
-	for (size_t i = historySize(); i > mu.historySize(); ) {
-		if (m_last_update_percept) {
-			// revert an observation and reward
-			for (size_t j = 0; j < (m_obs_bits + m_rew_bits); j++) {
-				m_ct->revert();
-			}
-			i -= (m_obs_bits + m_rew_bits);
-		} else {
-			// revert an action
-			m_ct->revertHistory(i - m_actions_bits);
-			i -= m_actions_bits;
-		}
-		m_last_update_percept = !m_last_update_percept;
-	}
+	// undo every update to the context tree and history since the save point
+	m_ct->rollback(mu.savepoint());
+
 	// revert other states
 	m_time_cycle = mu.age();
 	m_total_reward = mu.reward();
 	m_last_update_percept = mu.lastUpdate();
+	m_last_action = mu.lastAction();
+	m_last_observation = mu.lastObservation();
 	return true;
 }
 
@@ -227,7 +301,93 @@ void Agent::reset(void) {
 	m_ct->clear();
 
 	m_time_cycle = 0;
+	m_cycle = 0;
+	m_explore_rate = -1.0;
 	m_total_reward = 0.0;
+	m_last_update_percept = false; // the first update is a percept
+	m_last_action = 0;
+	m_last_observation = 0;
+}
+
+
+// what a checkpoint records about the agent ahead of its context trees
+struct AgentCheckpointRecord {
+	unsigned int actions;
+	unsigned int obs_bits;
+	unsigned int rew_bits;
+	unsigned int factors;
+	age_t time_cycle;
+	unsigned int cycle;
+	double explore_rate;
+	reward_t total_reward;
+	unsigned int last_update_percept;
+	action_t last_action;
+	percept_t last_observation;
+};
+
+// write the agent's model and counters to a checkpoint file. It is written
+// under a temporary name first, so a crash never leaves a torn checkpoint
+// behind in place of the last good one.
+bool Agent::save(const std::string &path) const {
+	// zeroed first, so that no stray padding bytes reach the file
+	AgentCheckpointRecord record;
+	memset(&record, 0, sizeof(record));
+	record.actions = m_actions;
+	record.obs_bits = m_obs_bits;
+	record.rew_bits = m_rew_bits;
+	record.factors = (unsigned int)m_ct->factors();
+	record.time_cycle = m_time_cycle;
+	record.cycle = m_cycle;
+	record.explore_rate = m_explore_rate;
+	record.total_reward = m_total_reward;
+	record.last_update_percept = m_last_update_percept;
+	record.last_action = m_last_action;
+	record.last_observation = m_last_observation;
+
+	std::string tmp = path + ".tmp";
+	CheckpointWriter out(tmp);
+	out.write(&record, sizeof(record));
+	m_ct->save(out);
+	if (!out.close() || rename(tmp.c_str(), path.c_str()) != 0) {
+		std::cerr << "ERROR: could not write checkpoint '" << path << "'" << std::endl;
+		remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+// read the agent's model and counters back from a checkpoint file
+bool Agent::load(const std::string &path) {
+	CheckpointReader in(path);
+	AgentCheckpointRecord record;
+	if (!in.read(&record, sizeof(record))) {
+		std::cerr << "ERROR: " << in.error() << std::endl;
+		return false;
+	}
+
+	if (record.actions != m_actions || record.obs_bits != m_obs_bits ||
+		record.rew_bits != m_rew_bits || record.factors != m_ct->factors()) {
+		std::cerr << "ERROR: checkpoint '" << path << "' is of an agent for a different environment" << std::endl;
+		return false;
+	}
+	if (!m_ct->load(in)) {
+		if (in.good()) {
+			std::cerr << "ERROR: checkpoint '" << path << "' has a different ct-depth or ct-node-format" << std::endl;
+		} else {
+			std::cerr << "ERROR: " << in.error() << std::endl;
+		}
+		reset();
+		return false;
+	}
+
+	m_time_cycle = record.time_cycle;
+	m_cycle = record.cycle;
+	m_explore_rate = record.explore_rate;
+	m_total_reward = record.total_reward;
+	m_last_update_percept = record.last_update_percept != 0;
+	m_last_action = record.last_action;
+	m_last_observation = record.last_observation;
+	return true;
 }
 
 // probability of selecting an action according to the
@@ -237,9 +397,18 @@ double Agent::getPredictedActionProb(action_t action) {
 }
 
 
-// get the agent's probability of receiving a particular percept
+// get the agent's probability of receiving a particular percept. The
+// context tree is left exactly as it was.
 double Agent::perceptProbability(percept_t observation, percept_t reward) const {
-	return NULL; // TODO: implement
+	symbol_list_t percept;
+	encodePercept(percept, observation, reward);
+	return m_ct->predict(percept);
+}
+
+// get the agent's probability of receiving every possible percept
+void Agent::perceptDistribution(std::vector<double> &dist) const {
+	// encodePercept puts the observation bits first, least significant first
+	m_ct->predictDistribution(m_obs_bits + m_rew_bits, dist);
 }
 
 
@@ -290,16 +459,17 @@ bool Agent::getLastUpdate(void) const {
 	return m_last_update_percept;
 }
 
-ModelUndo::~ModelUndo(void) {
-	delete m_revert_clone;
-}
-
 // used to revert an agent to a previous state
-// defunct deep copy code used for testing
-ModelUndo::ModelUndo(const Agent &agent) {
-	m_revert_clone = new Agent(agent);
-	m_age		  = agent.age();
-	m_reward	   = agent.reward();
-	m_history_size = agent.historySize();
-	m_last_update_percept = agent.getLastUpdate();
+ModelUndo::ModelUndo(Agent &agent) :
+	m_agent(agent),
+	m_age(agent.age()),
+	m_reward(agent.reward()),
+	m_last_update_percept(agent.getLastUpdate()),
+	m_last_action(agent.lastAction()),
+	m_last_observation(agent.lastObservation()),
+	m_savepoint(agent.m_ct->savepoint())
+{ return; }
+
+ModelUndo::~ModelUndo(void) {
+	m_agent.m_ct->release();
 }
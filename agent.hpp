@@ -5,19 +5,23 @@
 
 #include "main.hpp"
 
-class ContextTree;
+#include "predict.hpp"
 
 class ModelUndo;
 
 class Agent {
+	friend class ModelUndo; // opens and closes savepoints on m_ct
 
 public:
 
 	// construct a learning agent from the command line arguments
 	Agent(options_t & options);
 	
-	// construct an agent from another agent
-	Agent(const Agent &a);
+	// construct an agent from another agent. With SharedView the new
+	// agent's model is a copy-on-write view of the other's, see
+	// ContextTree, for running simulations on another thread. The other's
+	// model must have been refreshed first, see refreshModel().
+	Agent(const Agent &a, TreeCopy copy = DeepCopy);
 	
 	// destruct the agent and the corresponding context tree
 	~Agent(void);
@@ -25,6 +29,13 @@ public:
 	// current age of the agent in cycles
 	age_t age(void) const;
 
+	// the interaction cycle the main loop last finished and its exploration
+	// rate by then, negative if it doesn't explore. A checkpoint carries
+	// them, so that a resumed run decays exploration from where it stopped.
+	unsigned int cycle(void) const { return m_cycle; }
+	double exploreRate(void) const { return m_explore_rate; }
+	void setCycle(unsigned int cycle, double explore_rate);
+
 	// the total accumulated reward across an agents lifespan
 	reward_t reward(void) const;
 
@@ -46,6 +57,13 @@ public:
 	// length of the search horizon used by the agent
 	size_t horizon(void) const;
 
+	// the size and activity of the agent's model, see ContextTree::stats
+	void modelStats(CTStats &stats) const;
+
+	// recompute any weights the model has deferred, as it must have before
+	// it is shared
+	void refreshModel(void);
+
 	// generate an action uniformly at random
 	action_t genRandomAction(void) const;
   
@@ -61,6 +79,16 @@ public:
 	// update our mixture environment model with it
 	void genPerceptAndUpdate(percept_t *observation, percept_t *reward);
 
+	// generate a percept a bit at a time, as genPerceptAndUpdate() does,
+	// for a caller that keeps the bit probabilities: the probability that
+	// bit i of the percept is a 1, once the bits before it have been applied
+	// with modelUpdatePercept(), which counts the percept as received when
+	// its last bit is, and the observation and reward it stands for
+	unsigned int perceptBits(void) const { return m_obs_bits + m_rew_bits; }
+	double perceptBitProbability(size_t bit) { return m_ct->nextProbability(bit); }
+	void modelUpdatePercept(const symbol_list_t &percept, size_t from, size_t to);
+	void decodePercept(const symbol_list_t &percept, percept_t *observation, percept_t *reward) const;
+
 	// update the internal agent's model of the world
 	// due to receiving a percept or performing an action
 	void modelUpdate(percept_t observation, percept_t reward);
@@ -73,12 +101,24 @@ public:
 	// resets the agent
 	void reset(void);
 
+	// write the agent's model and counters to a checkpoint file, and read
+	// them back into an agent configured the same way. Both return false on
+	// failure, after saying why on std::cerr. A load that fails part way
+	// through resets the agent.
+	bool save(const std::string &path) const;
+	bool load(const std::string &path);
+
 	// probability of selecting an action according to the
 	// agent's internal model of it's own behaviour
 	double getPredictedActionProb(action_t action); // TODO: implement in agent.cpp
 
 	// get the agent's probability of receiving a particular percept
-	double perceptProbability(percept_t observation, percept_t reward) const; // TODO: implement in agent.cpp
+	double perceptProbability(percept_t observation, percept_t reward) const;
+
+	// get the agent's probability of receiving every possible percept,
+	// indexed by observation + reward * 2^(observation bits). Only for
+	// percepts of at most MaxDistributionBits bits.
+	void perceptDistribution(std::vector<double> &dist) const;
 	
 	// print out the agent's context tree
 	std::string prettyPrintContextTree() const;
@@ -88,8 +128,17 @@ public:
 	
 	int numSimulations(void) const;
 
+	// the wall-clock budget of a search in seconds, 0 to run a fixed number
+	// of simulations instead
+	double searchTime(void) const { return m_search_time; }
+
 	bool getLastUpdate(void) const;
 
+	// the most recent action the model was updated with, and the
+	// observation of the most recent percept
+	action_t lastAction(void) const { return m_last_action; }
+	percept_t lastObservation(void) const { return m_last_observation; }
+
 private:
 	// action sanity check
 	bool isActionOk(action_t action) const;
@@ -114,31 +163,47 @@ private:
 	
 	size_t m_horizon;			// length of the search horizon
 	int m_simulations;			// number of Monte Carlo simulations
+	double m_search_time;			// search time budget in seconds, or 0
 
-	// Context Tree representing the agent's beliefs
-	ContextTree *m_ct;
+	// Context Tree representing the agent's beliefs, factored into one tree
+	// per percept bit if the ct-factored option is set
+	FactoredContextTree *m_ct;
 
 	// How many time cycles the agent has been alive
 	age_t m_time_cycle;
 
+	// the main loop's cycle and exploration rate, see cycle()
+	unsigned int m_cycle;
+	double m_explore_rate;
+
 	// The total reward received by the agent
 	reward_t m_total_reward;
 
 	// True if the last update was a percept update
 	bool m_last_update_percept;
+
+	// the most recent action and observation
+	action_t m_last_action;
+	percept_t m_last_observation;
 };
 
 
-// used to store sufficient information to revert an agent
-// to a copy of itself from a previous time cycle
+// a save point on an agent's model. It records the agent's counters and a
+// position in the context tree's undo journal, so reverting to it never
+// copies the tree. Save points nest, and each one stays open, and can be
+// reverted to any number of times, until it goes out of scope.
 class ModelUndo {
 
 	public:
-		// construct a save point
-		ModelUndo(const Agent &agent);
+		// open a save point on the agent's model
+		ModelUndo(Agent &agent);
 
+		// close the save point, keeping the model as it is by then
 		~ModelUndo(void);
 
+		// the agent this save point belongs to
+		const Agent &agent(void) const { return m_agent; }
+
 		// saved state age accessor
 		age_t age(void) const { return m_age; }
 
@@ -146,16 +211,27 @@ class ModelUndo {
 		reward_t reward(void) const { return m_reward; }
 
 		// saved state history size accessor
-		size_t historySize(void) const { return m_history_size; }
+		size_t historySize(void) const { return m_savepoint.history; }
 
 		bool lastUpdate(void) const { return m_last_update_percept; }
 
+		// saved most recent action and observation accessors
+		action_t lastAction(void) const { return m_last_action; }
+		percept_t lastObservation(void) const { return m_last_observation; }
+
+		// position in the context tree's undo journal
+		const CTSavepoint &savepoint(void) const { return m_savepoint; }
+
 	private:
+		ModelUndo(const ModelUndo &other); // not implemented
+
+		Agent &m_agent;
 		age_t m_age;
 		reward_t m_reward;
-		size_t m_history_size;
-		Agent *m_revert_clone;
 		bool m_last_update_percept;
+		action_t m_last_action;
+		percept_t m_last_observation;
+		CTSavepoint m_savepoint;
 };
 
 
@@ -0,0 +1,145 @@
+#include "checkpoint.hpp"
+
+#include <cassert>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "predict.hpp"
+
+
+// the header this build writes, and expects to read
+static CheckpointHeader currentHeader(void) {
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, "CTWCKPT");
+	header.version = CheckpointVersion;
+	header.byte_order = 0x01020304;
+#ifdef CTW_FIXED_POINT
+	header.fixed_point = 1;
+#endif
+	header.node_size = sizeof(CTNode);
+	header.compact_node_size = sizeof(CTCompactNode);
+	header.compact_links_size = sizeof(CTCompactLinks);
+	header.compact_leaf_size = sizeof(CTCompactLeaf);
+	return header;
+}
+
+
+// create or truncate a checkpoint file, writing its header
+CheckpointWriter::CheckpointWriter(const std::string &path) :
+	m_out(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc),
+	m_offset(0)
+{
+	CheckpointHeader header = currentHeader();
+	write(&header, sizeof(header));
+}
+
+// append raw bytes
+void CheckpointWriter::write(const void *data, size_t bytes) {
+	m_out.write(static_cast<const char *>(data), bytes);
+	m_offset += bytes;
+}
+
+// pad with zeros up to the next CheckpointAlign boundary
+void CheckpointWriter::align(void) {
+	static const char zeros[4096] = { 0 };
+	size_t pad = (CheckpointAlign - m_offset % CheckpointAlign) % CheckpointAlign;
+	while (pad > 0) {
+		size_t n = pad < sizeof(zeros) ? pad : sizeof(zeros);
+		write(zeros, n);
+		pad -= n;
+	}
+}
+
+// flush and close the file
+bool CheckpointWriter::close(void) {
+	m_out.flush();
+	bool ok = m_out.good();
+	m_out.close();
+	return ok && !m_out.fail();
+}
+
+
+// open a checkpoint and check its header
+CheckpointReader::CheckpointReader(const std::string &path) :
+	m_fd(open(path.c_str(), O_RDONLY)),
+	m_offset(0),
+	m_size(0),
+	m_good(true)
+{
+	struct stat st;
+	if (m_fd < 0 || fstat(m_fd, &st) != 0) {
+		fail("cannot open '" + path + "'");
+		return;
+	}
+	m_size = size_t(st.st_size);
+
+	CheckpointHeader header, expected = currentHeader();
+	if (!read(&header, sizeof(header)) || memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0) {
+		fail("'" + path + "' is not a checkpoint");
+	} else if (header.version != expected.version) {
+		fail("'" + path + "' is from a different checkpoint version");
+	} else if (memcmp(&header, &expected, sizeof(header)) != 0) {
+		fail("'" + path + "' was written by an incompatible build or machine");
+	}
+}
+
+CheckpointReader::~CheckpointReader(void) {
+	if (m_fd >= 0) ::close(m_fd);
+}
+
+// record the first thing to go wrong
+void CheckpointReader::fail(const std::string &error) {
+	if (m_good) m_error = error;
+	m_good = false;
+}
+
+// read raw bytes
+bool CheckpointReader::read(void *data, size_t bytes) {
+	if (!good()) return false;
+
+	char *out = static_cast<char *>(data);
+	while (bytes > 0) {
+		ssize_t n = pread(m_fd, out, bytes, off_t(m_offset));
+		if (n <= 0) {
+			fail("checkpoint is truncated");
+			return false;
+		}
+		out += n;
+		m_offset += size_t(n);
+		bytes -= size_t(n);
+	}
+	return true;
+}
+
+// skip to the next CheckpointAlign boundary
+void CheckpointReader::align(void) {
+	m_offset += (CheckpointAlign - m_offset % CheckpointAlign) % CheckpointAlign;
+}
+
+// map the next bytes of the file copy on write
+void *CheckpointReader::map(size_t bytes) {
+	assert(m_offset % CheckpointAlign == 0);
+	if (!good()) return NULL;
+	if (m_offset + bytes > m_size) {
+		fail("checkpoint is truncated");
+		return NULL;
+	}
+
+	void *data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, m_fd, off_t(m_offset));
+	if (data == MAP_FAILED) {
+		fail("cannot map checkpoint");
+		return NULL;
+	}
+	m_offset += bytes;
+	return data;
+}
+
+// release a mapping returned by map()
+void CheckpointReader::unmap(void *data, size_t bytes) {
+	munmap(data, bytes);
+}
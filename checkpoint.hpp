@@ -0,0 +1,98 @@
+#ifndef __CHECKPOINT_HPP__
+#define __CHECKPOINT_HPP__
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+
+// Binary checkpoints of an agent's model. A checkpoint is a header followed
+// by a flat copy of each context tree's history and node arenas. The node
+// arrays are stored exactly as they sit in memory and start on
+// CheckpointAlign boundaries, so that loading can map whole arena blocks
+// straight from the file instead of reading them in. The mappings are
+// private: a loaded tree carries on learning and never writes back to the
+// file. Checkpoints are only meant to be loaded by a build of the same
+// version on the same kind of machine, which the header checks.
+
+// bumped whenever the layout of a checkpoint changes
+static const unsigned int CheckpointVersion = 4;
+
+// alignment of the node arrays, a multiple of the page size
+static const size_t CheckpointAlign = 65536;
+
+// the start of every checkpoint
+struct CheckpointHeader {
+	char magic[8];			// "CTWCKPT"
+	unsigned int version;		// CheckpointVersion
+	unsigned int byte_order;	// 0x01020304 as the writer stored it
+	unsigned int fixed_point;	// whether weights are fixed-point integers
+	unsigned int node_size;		// sizes of the stored node types
+	unsigned int compact_node_size;
+	unsigned int compact_links_size;
+	unsigned int compact_leaf_size;
+};
+
+// writes a checkpoint out sequentially
+class CheckpointWriter {
+public:
+	// create or truncate a checkpoint file, writing its header
+	CheckpointWriter(const std::string &path);
+
+	// false once anything has failed
+	bool good(void) const { return m_out.good(); }
+
+	// append raw bytes
+	void write(const void *data, size_t bytes);
+
+	// pad with zeros up to the next CheckpointAlign boundary
+	void align(void);
+
+	// flush and close the file, false if anything failed
+	bool close(void);
+
+private:
+	std::ofstream m_out;
+	size_t m_offset;
+};
+
+// reads a checkpoint back in sequentially, mapping what it can
+class CheckpointReader {
+public:
+	// open a checkpoint and check its header
+	CheckpointReader(const std::string &path);
+
+	~CheckpointReader(void);
+
+	// false once anything has failed, including an incompatible header
+	bool good(void) const { return m_fd >= 0 && m_good; }
+
+	// why good() is false
+	const std::string &error(void) const { return m_error; }
+
+	// read raw bytes, false on a short file
+	bool read(void *data, size_t bytes);
+
+	// skip to the next CheckpointAlign boundary
+	void align(void);
+
+	// map the next bytes of the file copy on write, NULL on failure. The
+	// reader must be at an aligned offset, and the mapping outlives it.
+	void *map(size_t bytes);
+
+	// release a mapping returned by map()
+	static void unmap(void *data, size_t bytes);
+
+private:
+	CheckpointReader(const CheckpointReader &other); // not implemented
+
+	// record the first thing to go wrong
+	void fail(const std::string &error);
+
+	int m_fd;
+	size_t m_offset;
+	size_t m_size;
+	bool m_good;
+	std::string m_error;
+};
+
+#endif // __CHECKPOINT_HPP__
@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <iostream>
 #include <cassert>
+#include <cmath>
+#include <cstdio>
 
 int main(int argc, char *argv[]) {
 	size_t ct_size = 4;
@@ -33,4 +35,261 @@ int main(int argc, char *argv[]) {
 	//std::cout << "Sequence: " << ctw.printHistory() << std::endl;
 	std::cout << "Copy + 1:" << std::endl << copy_tree.prettyPrint();
 	//std::cout << "Sequence: " << copy_tree.printHistory() << std::endl;
+
+	// The compact node format should agree with the standard one, as long
+	// as no counts have saturated
+	ContextTree compact_tree(ct_size, CompactNodes);
+	ContextTree standard_tree(ct_size);
+	for (int i = 0; i < 1000; i++) {
+		symbol_t sym = rand01() < 0.3;
+		compact_tree.update(sym);
+		standard_tree.update(sym);
+	}
+	std::cout << "Compact:" << std::endl << compact_tree.prettyPrint();
+	std::cout << "Standard log block probability: " << standard_tree.logBlockProbability() << std::endl;
+	std::cout << "Compact log block probability: " << compact_tree.logBlockProbability() << std::endl;
+	assert(fabs(compact_tree.logBlockProbability() - standard_tree.logBlockProbability()) < 0.001);
+	assert(compact_tree.size() == standard_tree.size());
+
+	// Rolling back to a savepoint restores the tree exactly
+	std::string before = standard_tree.prettyPrint();
+	CTSavepoint sp = standard_tree.savepoint();
+	for (int i = 0; i < 100; i++) {
+		standard_tree.update(rand01() < 0.5);
+	}
+	standard_tree.rollback(sp);
+	standard_tree.release();
+	assert(standard_tree.prettyPrint() == before);
+
+	// predict() agrees with the change in block probability an update makes
+	double p1 = standard_tree.predict(1);
+	double log_before = standard_tree.logBlockProbability();
+	sp = standard_tree.savepoint();
+	standard_tree.update(1);
+	assert(fabs(p1 - exp(standard_tree.logBlockProbability() - log_before)) < 1e-9);
+	standard_tree.rollback(sp);
+	standard_tree.release();
+	assert(fabs(standard_tree.predict(0) + p1 - 1.0) < 1e-4);
+
+	// The distribution over short sequences sums to one, matches predict(),
+	// and leaves the tree alone
+	before = standard_tree.prettyPrint();
+	std::vector<double> dist;
+	standard_tree.predictDistribution(4, dist);
+	double total = 0.0;
+	for (size_t i = 0; i < dist.size(); i++) total += dist[i];
+	assert(fabs(total - 1.0) < 1e-3);
+	symbol_list_t seq;
+	seq.push_back(1); seq.push_back(0); seq.push_back(1); seq.push_back(1);
+	assert(fabs(standard_tree.predict(seq) - dist[13]) < 1e-9);
+	assert(standard_tree.prettyPrint() == before);
+
+	// A factored model agrees with itself whether its trees are updated on
+	// one thread or several, and its distribution matches predict()
+	FactoredContextTree serial(ct_size, StandardNodes, 3, 1);
+	FactoredContextTree parallel(ct_size, StandardNodes, 3, 3);
+	for (int i = 0; i < 200; i++) {
+		symbol_list_t percept;
+		for (int j = 0; j < 3; j++) percept.push_back(rand01() < 0.3 + 0.2 * j);
+		serial.update(percept);
+		parallel.update(percept);
+	}
+	assert(serial.prettyPrint() == parallel.prettyPrint());
+	parallel.predictDistribution(3, dist);
+	total = 0.0;
+	for (size_t i = 0; i < dist.size(); i++) total += dist[i];
+	assert(fabs(total - 1.0) < 1e-3);
+	seq.pop_back();
+	assert(fabs(serial.predict(seq) - dist[5]) < 1e-9);
+
+	// A node budget bounds the tree, and pruning keeps it a proper model
+	ContextTree bounded(ct_size, StandardNodes);
+	bounded.setMaxNodes(20);
+	for (int i = 0; i < 1000; i++) {
+		bounded.update(rand01() < 0.3);
+		assert(bounded.size() <= 20);
+	}
+	assert(fabs(bounded.predict(0) + bounded.predict(1) - 1.0) < 1e-4);
+
+	// Weighing lazily gives the same model, whether it is read between
+	// updates or not, exactly so with integer weights, which sum exactly.
+	// Both formats that weigh lazily are checked.
+	for (int format = StandardNodes; format <= HashedNodes; format++) {
+		if (format == CompactNodes) continue;
+		ContextTree eager(8, NodeFormat(format)), lazy(8, NodeFormat(format));
+		lazy.setLazyWeights(true);
+		for (int i = 0; i < 2000; i++) {
+			symbol_t sym = rand01() < 0.3;
+#ifdef CTW_FIXED_POINT
+			if (i % 3 == 0) assert(eager.predict(sym) == lazy.predict(sym));
+#else
+			if (i % 3 == 0) assert(fabs(eager.predict(sym) - lazy.predict(sym)) < 1e-9);
+#endif
+			if (i % 7 == 0) {
+				CTSavepoint sp_eager = eager.savepoint(), sp_lazy = lazy.savepoint();
+				for (int j = 0; j < 5; j++) { eager.update(j & 1); lazy.update(j & 1); }
+				eager.rollback(sp_eager); eager.release();
+				lazy.rollback(sp_lazy); lazy.release();
+			}
+			eager.update(sym);
+			lazy.update(sym);
+			if (i % 11 == 0) { eager.revert(); lazy.revert(); }
+		}
+#ifdef CTW_FIXED_POINT
+		assert(eager.logBlockProbability() == lazy.logBlockProbability());
+		assert(eager.prettyPrint() == lazy.prettyPrint());
+#else
+		assert(fabs(eager.logBlockProbability() - lazy.logBlockProbability()) < 1e-6);
+#endif
+	}
+
+	// A hashed tree is the same model as a standard one, through rolled
+	// back updates, reverts and pruning
+	ContextTree linked(12, StandardNodes), hashed(12, HashedNodes);
+	for (int i = 0; i < 5000; i++) {
+		symbol_t sym = rand01() < 0.3;
+		assert(linked.predict(sym) == hashed.predict(sym));
+		if (i % 9 == 0) {
+			// every other time the outer savepoint keeps its updates
+			CTSavepoint sp_linked = linked.savepoint(), sp_hashed = hashed.savepoint();
+			for (int j = 0; j < 3; j++) { linked.update(j == 0); hashed.update(j == 0); }
+			CTSavepoint inner_linked = linked.savepoint(), inner_hashed = hashed.savepoint();
+			for (int j = 0; j < 6; j++) { linked.update(j % 3 == 0); hashed.update(j % 3 == 0); }
+			linked.rollback(inner_linked); linked.release();
+			hashed.rollback(inner_hashed); hashed.release();
+			if (i % 2 == 0) { linked.rollback(sp_linked); hashed.rollback(sp_hashed); }
+			linked.release();
+			hashed.release();
+		}
+		linked.update(sym);
+		hashed.update(sym);
+		if (i % 13 == 0) { linked.revert(); hashed.revert(); }
+	}
+	assert(linked.size() == hashed.size() && linked.prettyPrint() == hashed.prettyPrint());
+	assert(linked.logBlockProbability() == hashed.logBlockProbability());
+	linked.prune(1000);
+	hashed.prune(1000);
+	assert(linked.size() == hashed.size() && linked.prettyPrint() == hashed.prettyPrint());
+	for (int i = 0; i < 500; i++) {
+		symbol_t sym = rand01() < 0.3;
+		assert(linked.predict(sym) == hashed.predict(sym));
+		linked.update(sym);
+		hashed.update(sym);
+	}
+	assert(linked.prettyPrint() == hashed.prettyPrint());
+
+	// The batched KT multipliers match logKT, table range or not
+	unsigned int counts[11] = { 0, 1, 2, 7, 100, 4094, 4095, 4096, 70000, 3, 9 };
+	unsigned int others[11] = { 0, 5, 4095, 1, 9000, 0, 0, 2, 1, 4094, 8 };
+	double batch[11];
+	logKTBatch(counts, others, batch, 11);
+	for (int i = 0; i < 11; i++) assert(batch[i] == logKT(counts[i], others[i]));
+
+	// The weight arithmetic tracks the floating point log domain closely
+	for (int i = 0; i < 11; i++) {
+		assert(fabs(weightToLog(weightKT(counts[i], others[i])) - logKT(counts[i], others[i])) < 1e-6);
+	}
+	weight_t a = weightKT(3, 9), b = weightKT(100, 9000);
+	assert(fabs(weightToLog(weightAdd(a, b)) - logAdd(weightToLog(a), weightToLog(b))) < 1e-6);
+
+	// The history keeps a bounded window resident, more while pinned, and
+	// words of it agree with its symbols
+	CTHistory history(100);
+	for (int i = 0; i < 10000; i++) history.push_back(rand01() < 0.5);
+	assert(history.size() == 10000 && history.resident() >= 100 && history.resident() <= 128);
+	unsigned long long w = history.word(history.size() - 70, 64);
+	history.pin();
+	for (int i = 0; i < 1000; i++) history.push_back(rand01() < 0.5);
+	for (int i = 0; i < 1000; i++) history.pop_back();
+	history.unpin();
+	assert(history.resident() >= 100 && history.word(history.size() - 70, 64) == w);
+	for (int j = 0; j < 64; j++) assert(((w >> j) & 1) == history[history.size() - 70 + j]);
+
+	// A checkpoint round trip gives back the same model, including a
+	// tree big enough to have whole arena blocks mapped from the file
+	const char *path = "ctw_test.checkpoint";
+	for (int format = StandardNodes; format <= HashedNodes; format++) {
+		ContextTree saved(20, NodeFormat(format));
+		for (int i = 0; i < 40000; i++) saved.update(rand01() < 0.5);
+		CheckpointWriter out(path);
+		saved.save(out);
+		assert(out.close());
+
+		ContextTree loaded(20, NodeFormat(format));
+		CheckpointReader in(path);
+		assert(loaded.load(in));
+		assert(loaded.size() == saved.size() && saved.size() > 140000);
+		CTStats saved_stats, loaded_stats;
+		saved.stats(saved_stats);
+		loaded.stats(loaded_stats);
+		assert(loaded_stats.depth_nodes == saved_stats.depth_nodes);
+		assert(loaded.logBlockProbability() == saved.logBlockProbability());
+		for (int i = 0; i < 100; i++) {
+			symbol_t sym = rand01() < 0.5;
+			assert(loaded.predict(sym) == saved.predict(sym));
+			saved.update(sym);
+			loaded.update(sym);
+		}
+		assert(loaded.logBlockProbability() == saved.logBlockProbability());
+	}
+	remove(path);
+
+	// The nodes counted at each depth add up to the size of the tree
+	// through rolled back updates and pruning
+	for (int format = StandardNodes; format <= HashedNodes; format++) {
+		ContextTree counted(12, NodeFormat(format));
+		counted.setMaxNodes(500);
+		for (int i = 0; i < 3000; i++) {
+			if (i % 5 == 0) {
+				CTSavepoint sp = counted.savepoint();
+				for (int j = 0; j < 8; j++) counted.update(rand01() < 0.5);
+				counted.rollback(sp);
+				counted.release();
+			}
+			counted.update(rand01() < 0.3);
+		}
+		CTStats stats;
+		counted.stats(stats);
+		size_t nodes = 0;
+		for (size_t d = 0; d < stats.depth_nodes.size(); d++) nodes += stats.depth_nodes[d];
+		assert(nodes == counted.size() && stats.depth_nodes[0] == 1);
+		assert(stats.updates > 3000 && stats.reverts > 0 && stats.meanPathLength() < 13);
+	}
+
+	// A shared view behaves like a deep copy of the tree it shares, whose
+	// nodes it never touches
+	for (int format = StandardNodes; format <= HashedNodes; format++) {
+		ContextTree base(10, NodeFormat(format));
+		for (int i = 0; i < 3000; i++) base.update(rand01() < 0.3);
+		base.setMaxNodes(1000000);
+		std::string base_tree = base.prettyPrint();
+
+		ContextTree copy(base), view(base, SharedView);
+		assert(copy.maxNodes() == base.maxNodes() && view.maxNodes() == 0);
+		for (int i = 0; i < 3; i++) { copy.revert(); view.revert(); }
+		for (int i = 0; i < 500; i++) {
+			symbol_t sym = rand01() < 0.5;
+			assert(view.predict(sym) == copy.predict(sym));
+			if (i % 4 == 0) {
+				CTSavepoint sp_copy = copy.savepoint(), sp_view = view.savepoint();
+				for (int j = 0; j < 6; j++) { copy.update(j % 3 == 0); view.update(j % 3 == 0); }
+				copy.rollback(sp_copy); copy.release();
+				view.rollback(sp_view); view.release();
+			}
+			copy.update(sym);
+			view.update(sym);
+			if (i % 7 == 0) { copy.revert(); view.revert(); }
+		}
+		assert(view.size() == copy.size() && view.prettyPrint() == copy.prettyPrint());
+		assert(view.logBlockProbability() == copy.logBlockProbability());
+		assert(base.prettyPrint() == base_tree);
+	}
+
+#ifdef CTW_FIXED_POINT
+	// With fixed-point weights even a plain revert undoes an update exactly
+	log_before = standard_tree.logBlockProbability();
+	for (int i = 0; i < 50; i++) standard_tree.update(rand01() < 0.5);
+	for (int i = 0; i < 50; i++) standard_tree.revert();
+	assert(standard_tree.logBlockProbability() == log_before);
+#endif
 }
@@ -0,0 +1,96 @@
+#include "logmath.hpp"
+
+#if !defined(CTW_NO_SIMD) && !defined(CTW_EXACT_MATH) && (defined(__x86_64__) || defined(__i386__))
+#define CTW_AVX2
+#include <immintrin.h>
+#endif
+
+double g_log_half[LogTableSize];
+double g_log_int[LogTableSize];
+double g_log1p_exp[2 * Log1pExpRange * Log1pExpSteps + 2];
+
+#ifdef CTW_FIXED_POINT
+weight_t g_weight_log_int[LogTableSize + 1];
+weight_t g_weight_log1p_exp[Log1pExpRange * Log1pExpSteps + 2];
+#endif
+
+
+// logKTBatch, one node at a time
+static void logKTBatchScalar(const unsigned int *a, const unsigned int *b, double *out, size_t n) {
+	for (size_t i = 0; i < n; i++) out[i] = logKT(a[i], b[i]);
+}
+
+#ifdef CTW_AVX2
+// logKTBatch, four nodes at a time with the table lookups done as gathers.
+// Counts past the end of the tables are rare, they only turn up near the
+// root, and those lanes are redone with logKT.
+__attribute__((target("avx2")))
+static void logKTBatchAVX2(const unsigned int *a, const unsigned int *b, double *out, size_t n) {
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i last = _mm_set1_epi32(int(LogTableSize - 1));
+	const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+	const __m256d zero = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i vn = _mm_add_epi32(_mm_add_epi32(va, vb), one);
+
+		// clamp the indices so the gathers stay inside the tables
+		__m128i big = _mm_or_si128(_mm_cmpgt_epi32(va, last), _mm_cmpgt_epi32(vn, last));
+		big = _mm_or_si128(big, _mm_cmplt_epi32(vn, one)); // counts past 2^31
+		__m128i ia = _mm_min_epu32(va, last);
+		__m128i in = _mm_min_epu32(vn, last);
+
+		__m256d num = _mm256_mask_i32gather_pd(zero, g_log_half, ia, all, 8);
+		__m256d den = _mm256_mask_i32gather_pd(zero, g_log_int, in, all, 8);
+		_mm256_storeu_pd(out + i, _mm256_sub_pd(num, den));
+
+		if (_mm_movemask_epi8(big)) {
+			for (size_t j = i; j < i + 4; j++) out[j] = logKT(a[j], b[j]);
+		}
+	}
+	logKTBatchScalar(a + i, b + i, out + i, n - i);
+}
+#endif
+
+log_kt_batch_t logKTBatch = logKTBatchScalar;
+bool g_log_kt_batch_simd = false;
+
+// fills in the tables before main() runs
+static struct LogTables {
+	LogTables(void) {
+		g_log_int[0] = 0.0;
+		for (unsigned int n = 0; n < LogTableSize; n++) {
+			g_log_half[n] = log(n + 0.5);
+			if (n > 0) g_log_int[n] = log(double(n));
+		}
+
+		// one spare entry past the end so the interpolation can always
+		// read i + 1
+		const int entries = 2 * Log1pExpRange * Log1pExpSteps + 2;
+		for (int i = 0; i < entries; i++) {
+			double x = double(i) / Log1pExpSteps - Log1pExpRange;
+			g_log1p_exp[i] = log1p(exp(x));
+		}
+
+#ifdef CTW_FIXED_POINT
+		g_weight_log_int[0] = 0;
+		for (unsigned int n = 1; n <= LogTableSize; n++) {
+			g_weight_log_int[n] = logToWeight(log(double(n)));
+		}
+		for (int i = 0; i < Log1pExpRange * Log1pExpSteps + 2; i++) {
+			double x = double(i) / Log1pExpSteps - Log1pExpRange;
+			g_weight_log1p_exp[i] = logToWeight(log1p(exp(x)));
+		}
+#endif
+
+#ifdef CTW_AVX2
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			logKTBatch = logKTBatchAVX2;
+			g_log_kt_batch_simd = true;
+		}
+#endif
+	}
+} log_tables;
@@ -0,0 +1,149 @@
+#ifndef __LOGMATH_HPP__
+#define __LOGMATH_HPP__
+
+#include <cmath>
+#include <cstddef>
+
+// Log-domain arithmetic for the context tree: the KT-estimator multipliers
+// and log(exp(a) + exp(b)). These run for every node on every update,
+// revert and prediction, so by default they are table driven. Compile with
+// -DCTW_EXACT_MATH to compute everything with libm instead.
+
+// log(0.5), the prior weight of each half of a CTW mixture
+static const double LogHalf = -0.69314718055994530942;
+
+// counts below this use the log tables
+static const unsigned int LogTableSize = 4096;
+
+// log1p(exp(x)) is tabulated on [-Log1pExpRange, Log1pExpRange] with
+// Log1pExpSteps entries per unit. Linear interpolation keeps the absolute
+// error below 1e-5, outside the range it is below 1e-15.
+static const int Log1pExpRange = 36;
+static const int Log1pExpSteps = 64;
+
+// tables filled in at start up by logmath.cpp
+extern double g_log_half[LogTableSize];	// log(n + 0.5)
+extern double g_log_int[LogTableSize];	// log(n), g_log_int[0] unused
+extern double g_log1p_exp[2 * Log1pExpRange * Log1pExpSteps + 2];
+
+// logarithm of the KT-estimator multiplier for a symbol seen a times,
+// when the other symbol has been seen b times
+inline double logKT(unsigned int a, unsigned int b) {
+#ifdef CTW_EXACT_MATH
+	return log(a + 0.5) - log(a + b + 1.0);
+#else
+	unsigned int n = a + b + 1;
+	double num = a < LogTableSize ? g_log_half[a] : log(a + 0.5);
+	double den = n < LogTableSize ? g_log_int[n] : log(double(n));
+	return num - den;
+#endif
+}
+
+// log(1 + exp(x)), without overflowing for large x
+inline double log1pExp(double x) {
+	if (x >= Log1pExpRange) return x;
+#ifdef CTW_EXACT_MATH
+	return log1p(exp(x));
+#else
+	if (x <= -Log1pExpRange) return 0.0;
+	double pos = (x + Log1pExpRange) * Log1pExpSteps;
+	int i = int(pos);
+	double frac = pos - i;
+	return g_log1p_exp[i] + frac * (g_log1p_exp[i + 1] - g_log1p_exp[i]);
+#endif
+}
+
+// log(exp(a) + exp(b))
+inline double logAdd(double a, double b) {
+	return a > b ? a + log1pExp(b - a) : b + log1pExp(a - b);
+}
+
+// The weights of the standard context tree nodes: log probabilities, as
+// doubles by default. Compile with -DCTW_FIXED_POINT to hold them as 64-bit
+// integers in units of 2^-32 instead. Integer weights are only ever added,
+// subtracted and looked up in tables, so every update is exactly undone by
+// its revert, and the results don't depend on how the compiler schedules
+// floating point. The tables themselves are rounded from libm at start up,
+// or with -DCTW_EXACT_MATH as well every weight is rounded from libm as
+// it is needed.
+#ifdef CTW_FIXED_POINT
+
+typedef long long weight_t;
+
+// one nat, and log(0.5)
+static const weight_t WeightOne = 1LL << 32;
+static const weight_t WeightHalf = -2977044472LL;
+
+// tables filled in at start up by logmath.cpp, with a spare entry each
+// for interpolating past the last one
+extern weight_t g_weight_log_int[LogTableSize + 1];	// log(n), [0] unused
+extern weight_t g_weight_log1p_exp[Log1pExpRange * Log1pExpSteps + 2];
+
+inline double weightToLog(weight_t w) { return double(w) / double(WeightOne); }
+
+// a log probability rounded to a weight
+inline weight_t logToWeight(double x) { return weight_t(floor(x * double(WeightOne) + 0.5)); }
+
+// log(n) for any n > 0. Past the table, n = m 2^k with m in the upper half
+// of it, and log(n) = k log(2) + log(m + r / 2^k) interpolated.
+inline weight_t weightLog(unsigned long long n) {
+#ifdef CTW_EXACT_MATH
+	return logToWeight(log(double(n)));
+#else
+	if (n < LogTableSize) return g_weight_log_int[n];
+
+	static const weight_t Log2 = 2977044472LL;
+	int k = 0;
+	while ((n >> k) >= LogTableSize) k++;
+	unsigned long long m = n >> k;
+	long long r = (long long)(n - (m << k));
+	weight_t step = g_weight_log_int[m + 1] - g_weight_log_int[m];
+	return k * Log2 + g_weight_log_int[m] + ((step * r) >> k);
+#endif
+}
+
+// logKT as a weight: log(a + 0.5) = log(2a + 1) - log(2)
+inline weight_t weightKT(unsigned int a, unsigned int b) {
+	return weightLog(2ULL * a + 1) - weightLog(2ULL * (a + 1ULL + b));
+}
+
+// log(exp(a) + exp(b)) as a weight
+inline weight_t weightAdd(weight_t a, weight_t b) {
+	weight_t hi = a > b ? a : b;
+	weight_t diff = a > b ? b - a : a - b; // <= 0
+	if (diff <= -Log1pExpRange * WeightOne) return hi;
+#ifdef CTW_EXACT_MATH
+	return hi + logToWeight(log1p(exp(weightToLog(diff))));
+#else
+	// diff in table steps, as a 32-bit fraction
+	long long pos = (diff + Log1pExpRange * WeightOne) * Log1pExpSteps;
+	long long i = pos >> 32;
+	long long frac = pos & 0xffffffffLL;
+	weight_t step = g_weight_log1p_exp[i + 1] - g_weight_log1p_exp[i];
+	return hi + g_weight_log1p_exp[i] + ((step * frac) >> 32);
+#endif
+}
+
+#else
+
+typedef double weight_t;
+
+static const weight_t WeightHalf = LogHalf;
+
+inline double weightToLog(weight_t w) { return w; }
+inline weight_t weightKT(unsigned int a, unsigned int b) { return logKT(a, b); }
+inline weight_t weightAdd(weight_t a, weight_t b) { return logAdd(a, b); }
+
+#endif
+
+// logKT(a[i], b[i]) for every i below n, written to out. Called once per
+// update for the whole context path, so that the multipliers of every
+// depth are computed together: with AVX2, where the CPU has it, four at a
+// time. Compile with -DCTW_NO_SIMD to always use the scalar loop.
+typedef void (*log_kt_batch_t)(const unsigned int *a, const unsigned int *b, double *out, size_t n);
+extern log_kt_batch_t logKTBatch;
+
+// whether logKTBatch is the AVX2 kernel
+extern bool g_log_kt_batch_simd;
+
+#endif // __LOGMATH_HPP__
@@ -9,6 +9,7 @@
 
 #include "agent.hpp"
 #include "environment.hpp"
+#include "pool.hpp"
 #include "search.hpp"
 #include "util.hpp"
 
@@ -39,8 +40,45 @@ void mainLoop(Agent &ai, Environment &env, options_t &options) {
 		assert(0 <= terminate_age);
 	}
 
-	// Agent/environment interaction loop
-	for (unsigned int cycle = 1; !env.isFinished(); cycle++) {
+	// Determine where and how often to checkpoint the agent
+	std::string checkpoint = options["checkpoint-save"];
+	unsigned int checkpoint_interval;
+	strExtract(options["checkpoint-interval"], checkpoint_interval);
+
+	// Determine whether to keep the search tree from one cycle to the next
+	bool reuse_tree = options["mc-reuse-tree"] == "true";
+	SearchTree search_tree;
+
+	// Determine how many threads to search on, and whether they each
+	// search a tree of their own or all share one
+	size_t search_threads = strExtract<unsigned int>(options["search-threads"]);
+	if (search_threads < 1) search_threads = 1;
+	bool tree_parallel = options["search-parallel"] == "tree";
+	if (!tree_parallel && options["search-parallel"] != "root") {
+		std::cerr << "WARNING: unknown search-parallel '" << options["search-parallel"]
+			<< "', using root" << std::endl;
+	}
+	std::vector<SearchTree> search_trees(search_threads > 1 && !tree_parallel ? search_threads : 0);
+	SharedSearchTree shared_tree;
+	WorkerPool search_pool(search_threads);
+
+	// Determine whether searches run for a time rather than a number of
+	// simulations, in which case how many they fit in is logged
+	bool timed_search = ai.searchTime() > 0.0;
+	unsigned long long searches = 0, total_simulations = 0;
+
+	// Determine whether to log the model's statistics, and where the rates
+	// in them are measured from
+	bool log_stats = options["log-stats"] == "true";
+	CTStats last_stats;
+	if (log_stats) ai.modelStats(last_stats);
+	double last_time = clockSeconds();
+
+	// Agent/environment interaction loop, numbering cycles and decaying
+	// exploration on from where a checkpoint the agent was loaded from left
+	// off
+	if (explore && ai.exploreRate() >= 0.0) explore_rate = ai.exploreRate();
+	for (unsigned int cycle = ai.cycle() + 1; !env.isFinished(); cycle++) {
 
 		// check for agent termination
 		if (terminate_check && ai.age() > terminate_age) {
@@ -58,6 +96,7 @@ void mainLoop(Agent &ai, Environment &env, options_t &options) {
 		// Determine best exploitive action, or explore
 		action_t action;
 		bool explored = false;
+		int simulations = 0;
 		
 		if (DEBUGMODE){
 		 	//SPECIFY ACTIONS ON COMMAND LINE FOR TESTING
@@ -81,7 +120,25 @@ void mainLoop(Agent &ai, Environment &env, options_t &options) {
 				action = ai.genRandomAction();	
 			}
 			else {
-				action = search(ai);
+				if (search_threads > 1 && tree_parallel) {
+					if (!reuse_tree) shared_tree.clear();
+					action = search(ai, shared_tree, search_pool);
+					simulations = shared_tree.simulations();
+				} else if (search_threads > 1) {
+					if (!reuse_tree) {
+						for (size_t i = 0; i < search_trees.size(); i++) search_trees[i].clear();
+					}
+					action = search(ai, search_trees, search_pool);
+					for (size_t i = 0; i < search_trees.size(); i++) {
+						simulations += search_trees[i].simulations();
+					}
+				} else {
+					if (!reuse_tree) search_tree.clear();
+					action = search(ai, search_tree);
+					simulations = search_tree.simulations();
+				}
+				searches++;
+				total_simulations += simulations;
 			}
 		}
 
@@ -100,11 +157,36 @@ void mainLoop(Agent &ai, Environment &env, options_t &options) {
 		logFile << "explore rate: " << explore_rate << std::endl;
 		logFile << "total reward: " << ai.reward() << std::endl;
 		logFile << "average reward: " << ai.averageReward() << std::endl;
+		if (timed_search) logFile << "simulations: " << simulations << std::endl;
 
 		// LogFile the data in a more compact form
 		compactLog << cycle << ", " << observation << ", " << reward << ", "
 				<< action << ", " << explored << ", " << explore_rate << ", "
-				<< ai.reward() << ", " << ai.averageReward() << std::endl;
+				<< ai.reward() << ", " << ai.averageReward();
+
+		// along with the model's size and how hard it was worked this cycle
+		if (log_stats) {
+			CTStats stats;
+			ai.modelStats(stats);
+			double now = clockSeconds();
+			double elapsed = now > last_time ? now - last_time : 1e-9;
+			compactLog << ", " << stats.nodes << ", " << stats.bytes << ", "
+				<< (stats.updates - last_stats.updates) / elapsed << ", "
+				<< (stats.reverts - last_stats.reverts) / elapsed << ", "
+				<< (stats.predictions - last_stats.predictions) / elapsed << ", "
+				<< stats.meanPathLength();
+
+			logFile << "model nodes per depth:";
+			for (size_t d = 0; d < stats.depth_nodes.size(); d++) {
+				logFile << " " << stats.depth_nodes[d];
+			}
+			logFile << std::endl;
+
+			last_stats = stats;
+			last_time = now;
+		}
+		if (timed_search) compactLog << ", " << simulations;
+		compactLog << std::endl;
 
 		// Print to standard output when cycle == 2^n
 		if ((cycle & (cycle - 1)) == 0) {
@@ -121,13 +203,23 @@ void mainLoop(Agent &ai, Environment &env, options_t &options) {
 
 		// Update exploration rate
 		if (explore) explore_rate *= explore_decay;
+		ai.setCycle(cycle, explore ? explore_rate : -1.0);
 
+		// Save a checkpoint to resume from
+		if (!checkpoint.empty() && checkpoint_interval > 0 && cycle % checkpoint_interval == 0) {
+			ai.save(checkpoint);
+		}
 	}
 
+	if (!checkpoint.empty()) ai.save(checkpoint);
+
 	// Print summary to standard output
 	std::cout << std::endl << std::endl << "SUMMARY" << std::endl;
 	std::cout << "agent age: " << ai.age() << std::endl;
 	std::cout << "average reward: " << ai.averageReward() << std::endl;
+	if (timed_search && searches > 0) {
+		std::cout << "average simulations per search: " << double(total_simulations) / searches << std::endl;
+	}
 }
 
 
@@ -187,19 +279,28 @@ int main(int argc, char *argv[]) {
 	logFile.open((log_file).c_str());
 	compactLog.open((log_file + ".csv").c_str());
 
-	// Print header to compactLog
-	compactLog << "cycle, observation, reward, action, explored, explore_rate, total reward, average reward" << std::endl;
-
-
 	// Load configuration options
 	options_t options;
 
 	// Default configuration values
 	options["ct-depth"] = "4";
+	options["ct-node-format"] = "standard";	// "compact" or "hashed" store the nodes differently
+	options["ct-factored"] = "false";	// "true" gives each percept bit its own tree
+	options["ct-threads"] = "1";	// threads to update factored trees on
+	options["ct-max-nodes"] = "0";	// node budget, 0 for no limit
+	options["ct-lazy-weights"] = "false";	// "true" updates weights without reading siblings
+	options["checkpoint-load"] = "";	// checkpoint to start the agent from
+	options["checkpoint-save"] = "";	// checkpoint to save the agent to at the end
+	options["checkpoint-interval"] = "0";	// also save it every this many cycles
+	options["log-stats"] = "false";	// "true" logs the model's size and update rates
 	options["agent-horizon"] = "16";
 	options["exploration"] = "0";	 // do not explore
 	options["explore-decay"] = "1.0"; // exploration rate does not decay
 	options["mc-simulations"] = "100";
+	options["search-time-ms"] = "0";	// search for this long instead of mc-simulations, if not 0
+	options["mc-reuse-tree"] = "false";	// "true" searches on in the last cycle's tree
+	options["search-threads"] = "1";	// threads to search on
+	options["search-parallel"] = "root";	// "root" gives each search thread its own tree, "tree" shares one
 
 	// Read configuration options
 	std::ifstream conf(argv[1]);
@@ -210,6 +311,16 @@ int main(int argc, char *argv[]) {
 	processOptions(conf, options);
 	conf.close();
 
+	// Print header to compactLog
+	compactLog << "cycle, observation, reward, action, explored, explore_rate, total reward, average reward";
+	if (options["log-stats"] == "true") {
+		compactLog << ", model nodes, model bytes, updates/s, reverts/s, predictions/s, mean allocated path length";
+	}
+	if (strExtract<double>(options["search-time-ms"]) > 0.0) {
+		compactLog << ", simulations";
+	}
+	compactLog << std::endl;
+
 	// Set up the environment
 	Environment *env = NULL;
 
@@ -301,8 +412,11 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 
-	// Set up the agent
+	// Set up the agent, warm starting it from a checkpoint if asked to
 	Agent ai(options);
+	if (!options["checkpoint-load"].empty() && !ai.load(options["checkpoint-load"])) {
+		return -1;
+	}
 
 	// Run the main agent/environment interaction loop
 	mainLoop(ai, *env, options);
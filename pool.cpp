@@ -0,0 +1,102 @@
+#include "pool.hpp"
+
+#include <cassert>
+
+
+// start a pool running batches on the given number of threads
+WorkerPool::WorkerPool(size_t threads) :
+	m_task(NULL),
+	m_context(NULL),
+	m_tasks(0),
+	m_next(0),
+	m_pending(0),
+	m_batch(0),
+	m_stop(false)
+{
+	pthread_mutex_init(&m_mutex, NULL);
+	pthread_cond_init(&m_start, NULL);
+	pthread_cond_init(&m_done, NULL);
+
+	// the caller makes up the last thread
+	for (size_t i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, workerMain, this) != 0) break;
+		m_workers.push_back(thread);
+	}
+}
+
+// stop and join the workers
+WorkerPool::~WorkerPool(void) {
+	pthread_mutex_lock(&m_mutex);
+	m_stop = true;
+	pthread_cond_broadcast(&m_start);
+	pthread_mutex_unlock(&m_mutex);
+
+	for (size_t i = 0; i < m_workers.size(); i++) {
+		pthread_join(m_workers[i], NULL);
+	}
+
+	pthread_cond_destroy(&m_done);
+	pthread_cond_destroy(&m_start);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+
+// run task(context, i) for every i in [0, tasks)
+void WorkerPool::run(size_t tasks, task_t task, void *context) {
+	// not worth waking anyone for
+	if (m_workers.empty() || tasks < 2) {
+		for (size_t i = 0; i < tasks; i++) task(context, i);
+		return;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	assert(m_pending == 0);
+	m_task = task;
+	m_context = context;
+	m_tasks = tasks;
+	m_next = 0;
+	m_pending = tasks;
+	m_batch++;
+	pthread_cond_broadcast(&m_start);
+
+	work();
+	while (m_pending > 0) pthread_cond_wait(&m_done, &m_mutex);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+
+// entry point of the worker threads
+void *WorkerPool::workerMain(void *pool) {
+	WorkerPool &p = *static_cast<WorkerPool *>(pool);
+
+	pthread_mutex_lock(&p.m_mutex);
+	unsigned long seen = p.m_batch;
+	for (;;) {
+		while (!p.m_stop && p.m_batch == seen) {
+			pthread_cond_wait(&p.m_start, &p.m_mutex);
+		}
+		if (p.m_stop) break;
+
+		seen = p.m_batch;
+		p.work();
+	}
+	pthread_mutex_unlock(&p.m_mutex);
+	return NULL;
+}
+
+
+// claim and run tasks from the current batch until none are left
+void WorkerPool::work(void) {
+	while (m_next < m_tasks) {
+		size_t i = m_next++;
+		task_t task = m_task;
+		void *context = m_context;
+
+		pthread_mutex_unlock(&m_mutex);
+		task(context, i);
+		pthread_mutex_lock(&m_mutex);
+
+		if (--m_pending == 0) pthread_cond_broadcast(&m_done);
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef __POOL_HPP__
+#define __POOL_HPP__
+
+#include <cstddef>
+#include <vector>
+
+#include <pthread.h>
+
+// A small fixed pool of worker threads for running batches of independent
+// tasks, such as updating each tree of a factored context tree. The calling
+// thread works through the batch too, so a pool of one thread starts no
+// workers and runs everything inline.
+class WorkerPool {
+public:
+	// a task: called once with each index of the batch
+	typedef void (*task_t)(void *context, size_t index);
+
+	// start a pool running batches on the given number of threads,
+	// counting the caller
+	WorkerPool(size_t threads);
+
+	// stop and join the workers
+	~WorkerPool(void);
+
+	// run task(context, i) for every i in [0, tasks), returning once all of
+	// them have finished
+	void run(size_t tasks, task_t task, void *context);
+
+	// number of threads a batch is spread over, counting the caller
+	size_t threads(void) const { return m_workers.size() + 1; }
+
+private:
+	WorkerPool(const WorkerPool &other); // not implemented
+
+	// entry point of the worker threads
+	static void *workerMain(void *pool);
+
+	// claim and run tasks from the current batch until none are left,
+	// called and returning with m_mutex held
+	void work(void);
+
+	std::vector<pthread_t> m_workers;
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_start;		// signalled when a batch starts or the pool stops
+	pthread_cond_t m_done;		// signalled when the last task of a batch finishes
+
+	// the current batch, guarded by m_mutex
+	task_t m_task;
+	void *m_context;
+	size_t m_tasks;		// number of tasks in the batch
+	size_t m_next;		// next task to hand out
+	size_t m_pending;	// tasks not yet finished
+	unsigned long m_batch;	// counts batches, so workers can tell a new one
+	bool m_stop;
+};
+
+#endif // __POOL_HPP__
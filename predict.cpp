@@ -5,6 +5,7 @@
 #include <string>
 #include <cassert>
 #include <cmath> // "log" is a BAD idea dude
+#include "pool.hpp"
 #include "util.hpp"
 #include <limits>
 
@@ -15,149 +16,920 @@ CTNode::CTNode(void) :
 {
 	m_count[0] = 0;
 	m_count[1] = 0;
-	m_child[0] = NULL;
-	m_child[1] = NULL;
+	m_child[0] = 0;
+	m_child[1] = 0;
 }
 
-CTNode::CTNode(const CTNode &other) :
-	m_log_prob_est(other.m_log_prob_est),
-	m_log_prob_weighted(other.m_log_prob_weighted)
+
+// largest count a compact node can hold before both counts are halved
+static const unsigned int CompactCountMax = std::numeric_limits<compact_count_t>::max();
+
+// compact log ratios are clamped to this magnitude, well past the point
+// where either side of the mixture has any influence left
+static const double CompactLogBetaMax = 1000.0;
+
+
+// add a symbol to a pair of compact counts, halving both of them first
+// if the symbol's count is about to saturate
+static void compactCount(compact_count_t count[2], symbol_t sym) {
+	if (count[sym] == CompactCountMax) {
+		count[0] = compact_count_t((count[0] + 1) / 2);
+		count[1] = compact_count_t((count[1] + 1) / 2);
+	}
+	count[sym]++;
+}
+
+// remove a symbol from a pair of compact counts. After a halving the count
+// may already be zero, in which case there is nothing left to remove.
+static void compactUncount(compact_count_t count[2], symbol_t sym) {
+	if (count[sym] > 0) count[sym]--;
+}
+
+static float clampLogBeta(double log_beta) {
+	if (log_beta > CompactLogBetaMax) return float(CompactLogBetaMax);
+	if (log_beta < -CompactLogBetaMax) return float(-CompactLogBetaMax);
+	return float(log_beta);
+}
+
+
+// the multiplier of the suffix hash of a context: the bit i back in the
+// history, counting the most recent as bit 0, adds HashMultiplier^i times
+// one more than the bit, so that contexts of different depths differ too
+static const context_hash_t HashMultiplier = 0x9e3779b97f4a7c15ULL;
+
+// a hashed node's key is the suffix hash of its context cut down to
+// HashMask, with HashLive set. The bits above it say which children the
+// node has, so that only contexts that exist are ever looked up, and
+// HashPruned that it has been pruned into a leaf. Empty slots hold 0, and
+// the slots of erased nodes HashErased.
+static const context_hash_t HashMask = (1ULL << 60) - 1;
+static const context_hash_t HashFirstChild = 1ULL << 60;
+static const context_hash_t HashLive = 1ULL << 62;
+static const context_hash_t HashPruned = 1ULL << 63;
+static const context_hash_t HashKeyBits = HashMask | HashLive;
+static const context_hash_t HashErased = 1;
+
+// spreads the key bits over the top bits, which pick the slot
+static const context_hash_t HashSpread = 0xff51afd7ed558ccdULL;
+
+// the smallest table a hashed tree has
+static const size_t HashMinSlots = 64;
+
+// marks m_suffix_hash as needing to be recomputed from scratch
+static const size_t HashStale = ~size_t(0);
+
+// the key of the context whose suffix hash is hash
+static context_hash_t hashKey(context_hash_t hash) {
+	return (hash & HashMask) | HashLive;
+}
+
+// the bit of a hashed node's key saying it has a child for a symbol
+static context_hash_t hashChild(symbol_t sym) {
+	return HashFirstChild << sym;
+}
+
+// the slot a key's probe starts from
+static node_index_t hashSlot(const CTHashTable &table, context_hash_t key) {
+	return node_index_t(table.base + ((key * HashSpread) >> table.shift));
+}
+
+
+// history symbols a context tree keeps resident beyond its context, unless
+// told otherwise by setHistoryWindow()
+static const size_t DefaultHistoryWindow = 64;
+
+// a history keeping at least window symbols resident
+CTHistory::CTHistory(size_t window) :
+	m_words(1, 0),
+	m_word_mask(0),
+	m_size(0),
+	m_first(0),
+	m_window(0)
 {
-	m_count[0] = other.m_count[0];
-	m_count[1] = other.m_count[1];
-	if (other.m_child[0]) {
-		m_child[0] = new CTNode(*other.m_child[0]);
-	} else {
-		m_child[0] = NULL;
+	setWindow(window);
+}
+
+// forget every symbol
+void CTHistory::clear(void) {
+	m_size = 0;
+	m_first = 0;
+}
+
+// raise the guaranteed number of resident symbols
+void CTHistory::setWindow(size_t window) {
+	m_window = window;
+	while (m_words.size() * 64 < m_window) grow();
+}
+
+// add a symbol, overwriting the oldest resident one if the buffer is full
+// and no pin still needs it
+void CTHistory::push_back(symbol_t sym) {
+	if (m_size - m_first == m_words.size() * 64) {
+		size_t keep = m_size;
+		for (size_t i = 0; i < m_pins.size(); i++) keep = std::min(keep, m_pins[i]);
+		if (m_first + m_window < keep) {
+			m_first++;
+		} else {
+			grow();
+		}
 	}
-	if (other.m_child[1]) {
-		m_child[1] = new CTNode(*other.m_child[1]);
-	} else {
-		m_child[1] = NULL;
+
+	unsigned long long &w = m_words[(m_size >> 6) & m_word_mask];
+	unsigned long long bit = 1ULL << (m_size & 63);
+	if (sym) w |= bit; else w &= ~bit;
+	m_size++;
+}
+
+// n <= 64 resident symbols from position i on, symbol i + j in bit j
+unsigned long long CTHistory::word(size_t i, size_t n) const {
+	assert(0 < n && n <= 64 && m_first <= i && i + n <= m_size);
+
+	size_t shift = i & 63;
+	unsigned long long w = m_words[(i >> 6) & m_word_mask] >> shift;
+	if (shift + n > 64) w |= m_words[((i >> 6) + 1) & m_word_mask] << (64 - shift);
+	return n < 64 ? w & ((1ULL << n) - 1) : w;
+}
+
+// double the ring buffer, moving the resident symbols to their new words
+void CTHistory::grow(void) {
+	std::vector<unsigned long long> words(m_words.size() * 2, 0);
+	size_t mask = words.size() - 1;
+	for (size_t i = m_first; i < m_size; i++) {
+		if ((*this)[i]) words[(i >> 6) & mask] |= 1ULL << (i & 63);
+	}
+	m_words.swap(words);
+	m_word_mask = mask;
+}
+
+// what a checkpoint records about a history ahead of its resident symbols
+struct CTHistoryRecord {
+	unsigned long long size;
+	unsigned long long resident;
+};
+
+// write the resident symbols to a checkpoint, 64 to a word
+void CTHistory::save(CheckpointWriter &out) const {
+	CTHistoryRecord record = { m_size, resident() };
+	out.write(&record, sizeof(record));
+	for (size_t i = m_first; i < m_size; i += 64) {
+		unsigned long long w = word(i, std::min<size_t>(64, m_size - i));
+		out.write(&w, sizeof(w));
 	}
 }
 
-CTNode::~CTNode(void) {
-	if (m_child[0]) delete m_child[0];
-	if (m_child[1]) delete m_child[1];
+// read them back
+bool CTHistory::load(CheckpointReader &in) {
+	CTHistoryRecord record;
+	if (!in.read(&record, sizeof(record)) || record.resident > record.size) return false;
+
+	while (m_words.size() * 64 < record.resident) grow();
+	m_size = m_first = size_t(record.size - record.resident);
+	for (size_t i = 0; i < record.resident; i += 64) {
+		unsigned long long w;
+		if (!in.read(&w, sizeof(w))) return false;
+		for (size_t j = 0; j < 64 && i + j < record.resident; j++) push_back((w >> j) & 1);
+	}
+	return true;
 }
 
-// number of descendants of a node in the context tree
-size_t CTNode::size(void) const {
 
-	size_t rval = 1;
-	rval += child(false) ? child(false)->size() : 0;
-	rval += child(true)  ? child(true)->size()  : 0;
-	return rval;
+// release every node of a compact tree at once
+void CTCompactArena::clear(void) {
+	m_nodes.clear();
+	m_links.clear();
+	m_leaves.clear();
+	m_leaves.alloc(); // reserved, see CTCompactArena
 }
 
 
-// compute the logarithm of the KT-estimator update multiplier
-double CTNode::logKTMul(symbol_t sym) const {
-	// next-term pseudo-Laplace estimator, doesn't update m_count[]
-	int temp = m_count[sym];
-	int temp2 = m_count[1 - sym]; // other symbol
-	return log(temp + 0.5) - log(temp + temp2 + 1);
+// write the three arrays of a compact tree to a checkpoint
+void CTCompactArena::save(CheckpointWriter &out) const {
+	m_nodes.save(out);
+	m_links.save(out);
+	m_leaves.save(out);
+}
+
+// read them back, nodes and leaves long
+bool CTCompactArena::load(CheckpointReader &in, size_t nodes, size_t leaves) {
+	return m_nodes.load(in, nodes) && m_links.load(in, nodes) && m_leaves.load(in, leaves);
 }
 
 
+// defined here as well, as m_path's constructor binds it to a reference
+const node_index_t ContextTree::Root;
+
 // create a context tree of specified maximum depth
-ContextTree::ContextTree(size_t depth) :
-	m_root(new CTNode()),
-	m_depth(depth)
-{ return; }
+ContextTree::ContextTree(size_t depth, NodeFormat format) :
+	m_history(depth + DefaultHistoryWindow),
+	m_depth(depth),
+	m_format(format),
+	m_root(Root),
+	m_shared_nodes(0),
+	m_shared_leaves(0),
+	m_table(),
+	m_scratch(),
+	m_suffix_hash(depth + 1, 0),
+	m_hash_power(depth + 1, 1),
+	m_hash_history(HashStale),
+	m_path(depth + 1, Root),
+	m_leaf_depth(depth),
+	m_context(depth + 1, 0),
+	m_path_count(depth + 1, 0),
+	m_path_other(depth + 1, 0),
+	m_path_log_kt(depth + 1, 0),
+	m_savepoints(0),
+	m_max_nodes(0),
+	m_lazy_weights(false),
+	m_depth_nodes(depth + 1, 0),
+	m_created_depth(depth + 1),
+	m_updates(0),
+	m_reverts(0),
+	m_predictions(0),
+	m_path_nodes(0)
+{
+	for (size_t d = 1; d <= depth; d++) {
+		m_hash_power[d] = m_hash_power[d - 1] * HashMultiplier;
+	}
+	selectEngine();
+	clear();
+}
+
+// create a context tree from another context tree, or a view of it
+ContextTree::ContextTree(const ContextTree &ct, TreeCopy copy) :
+	m_history(ct.m_history),
+	m_depth(ct.m_depth),
+	m_format(ct.m_format),
+	m_nodes(ct.m_nodes, copy),
+	m_compact(ct.m_compact, copy),
+	m_root(ct.m_root),
+	m_shared_nodes(ct.m_shared_nodes),
+	m_shared_leaves(ct.m_shared_leaves),
+	m_log_block_prob(ct.m_log_block_prob),
+	m_table(ct.m_table),
+	m_scratch(ct.m_scratch),
+	m_shared_tables(ct.m_shared_tables),
+	m_suffix_hash(ct.m_suffix_hash),
+	m_hash_power(ct.m_hash_power),
+	m_hash_history(ct.m_hash_history),
+	m_created(ct.m_created),
+	m_path(ct.m_depth + 1, Root),
+	m_leaf_depth(ct.m_depth),
+	m_context(ct.m_depth + 1, 0),
+	m_path_count(ct.m_depth + 1, 0),
+	m_path_other(ct.m_depth + 1, 0),
+	m_path_log_kt(ct.m_depth + 1, 0),
+	m_journal(ct.m_journal),
+	m_compact_journal(ct.m_compact_journal),
+	m_frames(ct.m_frames),
+	m_savepoints(ct.m_savepoints),
+	m_max_nodes(copy == SharedView ? 0 : ct.m_max_nodes),
+	m_walk_path(ct.m_walk_path),
+	m_lazy_weights(ct.m_lazy_weights),
+	m_depth_nodes(ct.m_depth_nodes),
+	m_created_depth(ct.m_created_depth),
+	m_updates(ct.m_updates),
+	m_reverts(ct.m_reverts),
+	m_predictions(ct.m_predictions),
+	m_path_nodes(ct.m_path_nodes)
+{
+	if (copy == DeepCopy) return;
+	assert(ct.m_savepoints == 0);
+	assert(ct.m_format == CompactNodes || !ct.m_nodes[ct.m_root].dirty());
 
-ContextTree::ContextTree(const ContextTree &ct){
-	m_depth = ct.m_depth;
-	// vector should copy automatically, as it is of simple types
-	m_history = ct.m_history;
-	m_root = new CTNode(*ct.m_root);
+	// the view writes every update's path, starting at the root, so give
+	// it a root of its own straight away
+	m_shared_nodes = m_format == CompactNodes ? m_compact.nodes() : m_nodes.size();
+	m_shared_leaves = m_compact.leaves();
+	m_root = unshareNode(0, m_root);
+
+	// a hashed view looks its nodes up in a table of its own first, whose
+	// copies shadow the shared ones
+	if (m_format == HashedNodes) {
+		m_shared_tables.insert(m_shared_tables.begin(), m_table);
+		newTable(m_table, HashMinSlots);
+	}
 }
 
 
 // Printing CTW for debugging
 // Let's print some REALLY REALLY PRETTY STRINGS
-std::string CTNode::prettyPrintNode(int depth) {
-	std::string answer;
+std::string ContextTree::prettyPrintNode(node_index_t idx, int depth) const {
+	const CTNode &node = m_nodes[idx];
+	std::ostringstream answer;
+	for (int i = 0; i < depth; i++) {
+		answer << "\t";
+	}
+
+	answer << "e=" << std::setprecision(8) << weightToLog(node.m_log_prob_est);
+	answer << ", ";
+	answer << "w=" << std::setprecision(8) << weightToLog(node.logProbWeighted());
+	answer << ": (" << node.m_count[0] << "," << node.m_count[1] << ")\n";
+	if (isLeaf(depth, idx)) return answer.str();
+	node_index_t child = childNode(depth, idx, false);
+	if (child)
+		answer << "0   " << prettyPrintNode(child, depth + 1);
+	child = childNode(depth, idx, true);
+	if (child)
+		answer << "1   " << prettyPrintNode(child, depth + 1);
+	return answer.str();
+}
+
+std::string ContextTree::prettyPrintCompact(node_index_t idx, int depth) const {
+	std::ostringstream answer;
 	for (int i = 0; i < depth; i++) {
-		answer.append("\t");
+		answer << "\t";
+	}
+
+	if (size_t(depth) == m_depth) {
+		const CTCompactLeaf &leaf = m_compact.leaf(idx);
+		answer << "(" << leaf.count[0] << "," << leaf.count[1] << ")\n";
+		return answer.str();
 	}
 
-	std::string count0 = static_cast<std::ostringstream*>( &(std::ostringstream() << m_count[0]) )->str();
-	std::string count1 = static_cast<std::ostringstream*>( &(std::ostringstream() << m_count[1]) )->str();
-	std::ostringstream double_to_str_stream;
-	double_to_str_stream << "e=" << std::setprecision(8) << m_log_prob_est;
-	double_to_str_stream << ", ";
-	double_to_str_stream << "w=" << std::setprecision(8) << m_log_prob_weighted;
-	std::string log_prob_str = double_to_str_stream.str();
-	answer.append(log_prob_str+": (" +
-			count0 + "," + count1 + ")\n"); 
-	if(m_child[0] != NULL)
-		answer.append("0   "+m_child[0]->prettyPrintNode(depth + 1));
-	if(m_child[1] != NULL)
-		answer.append("1   "+m_child[1]->prettyPrintNode(depth + 1));
-	return answer;
+	const CTCompactNode &node = m_compact.node(idx);
+	const CTCompactLinks &links = m_compact.links(idx);
+	answer << "b=" << std::setprecision(8) << node.log_beta;
+	answer << ": (" << node.count[0] << "," << node.count[1] << ")\n";
+	if (links.child[0] == PrunedLeaf) return answer.str();
+	if (links.child[0])
+		answer << "0   " << prettyPrintCompact(links.child[0], depth + 1);
+	if (links.child[1])
+		answer << "1   " << prettyPrintCompact(links.child[1], depth + 1);
+	return answer.str();
 }
 
 std::string ContextTree::prettyPrint(void) {
-	return m_root->prettyPrintNode(0);
+	refreshWeights();
+	if (m_format == CompactNodes) return prettyPrintCompact(m_root, 0);
+	return prettyPrintNode(m_root, 0);
 }
 
 // print's the agent's history in the format O R A R A O R ...
 std::string ContextTree::printHistory(void) {
-	std::string answer;
-	history_t::iterator history_iterator = m_history.begin();
-
-	while (history_iterator != m_history.end())
-		answer.append(" "+static_cast<std::ostringstream*>( &(std::ostringstream() <<(*history_iterator++)) )->str());
-	return answer;
+	std::ostringstream answer;
+	for (size_t i = m_history.size() - m_history.resident(); i < m_history.size(); i++)
+		answer << " " << m_history[i];
+	return answer.str();
 }
 
 ContextTree::~ContextTree(void) {
-	if (m_root) delete m_root;
+	return;
 }
 
 
-// clear the entire context tree
+// clear the entire context tree, releasing every node at once
 void ContextTree::clear(void) {
 	m_history.clear();
-	if (m_root) delete m_root;
-	m_root = new CTNode();
+	m_nodes.clear();
+	m_compact.clear();
+	m_log_block_prob = 0.0;
+
+	// nothing left to undo, but open savepoints stay open
+	m_journal.clear();
+	m_compact_journal.clear();
+	m_frames.clear();
+	m_created.clear();
+
+	// a view is on its own from here
+	m_root = Root;
+	m_shared_nodes = 0;
+	m_shared_leaves = 0;
+	m_shared_tables.clear();
+	m_scratch = CTHashTable();
+	m_hash_history = HashStale;
+
+	if (m_format != CompactNodes) {
+		m_nodes.alloc();
+		if (m_format == HashedNodes) newTable(m_table, HashMinSlots);
+	} else if (m_depth > 0) {
+		m_compact.allocNode();
+	} // else the root is the reserved compact leaf
+	std::fill(m_depth_nodes.begin(), m_depth_nodes.end(), 0);
+	m_depth_nodes[0] = 1;
+}
+
+
+// number of nodes in the context tree
+size_t ContextTree::size(void) const {
+	// a view's arenas hold its copies of shared nodes as well as its own
+	if (isView()) {
+		size_t nodes = 0;
+		for (size_t d = 0; d <= m_depth; d++) nodes += m_depth_nodes[d];
+		return nodes;
+	}
+	if (m_format == StandardNodes) return m_nodes.size();
+	if (m_format == HashedNodes) return m_table.live + m_scratch.live + 1;
+	return m_compact.size() + (m_depth == 0 ? 1 : 0);
+}
+
+CTStats::CTStats(void) :
+	nodes(0),
+	bytes(0),
+	updates(0),
+	reverts(0),
+	predictions(0),
+	path_nodes(0)
+{ return; }
+
+// add another tree's statistics to these
+void CTStats::add(const CTStats &other) {
+	nodes += other.nodes;
+	if (depth_nodes.size() < other.depth_nodes.size()) depth_nodes.resize(other.depth_nodes.size(), 0);
+	for (size_t d = 0; d < other.depth_nodes.size(); d++) depth_nodes[d] += other.depth_nodes[d];
+	bytes += other.bytes;
+	updates += other.updates;
+	reverts += other.reverts;
+	predictions += other.predictions;
+	path_nodes += other.path_nodes;
+}
+
+// mean number of nodes on the context path of an update
+double CTStats::meanPathLength(void) const {
+	return updates > 0 ? double(path_nodes) / double(updates) : 0.0;
+}
+
+// the size and activity of the tree
+void ContextTree::stats(CTStats &stats) const {
+	stats.nodes = size();
+	stats.depth_nodes = m_depth_nodes;
+	stats.bytes = sizeof(*this) + m_nodes.capacity() + m_compact.capacity() +
+		m_history.bytes() +
+		m_journal.capacity() * sizeof(CTJournalEntry) +
+		m_compact_journal.capacity() * sizeof(CTCompactJournalEntry) +
+		m_frames.capacity() * sizeof(CTJournalFrame) +
+		m_created.capacity() * sizeof(node_index_t);
+	stats.updates = m_updates;
+	stats.reverts = m_reverts;
+	stats.predictions = m_predictions;
+	stats.path_nodes = m_path_nodes;
+}
+
+// recount the nodes at each depth from scratch
+void ContextTree::countNodes(void) {
+	std::fill(m_depth_nodes.begin(), m_depth_nodes.end(), 0);
+	countNodes(0, m_root);
+}
+
+void ContextTree::countNodes(size_t depth, node_index_t idx) {
+	m_depth_nodes[depth]++;
+	if (isLeaf(depth, idx)) return;
+
+	for (int sym = 0; sym < 2; sym++) {
+		node_index_t child = childNode(depth, idx, sym != 0);
+		if (child) countNodes(depth + 1, child);
+	}
+}
+
+// recompute the weighted probability of an internal node from its
+// estimator and the summed log weighted probabilities of its children
+void CTNode::updateWeighted(weight_t log_prob_children) {
+	// If there's nothing under us then we're a leaf again
+	if (!visits()) {
+		m_log_prob_weighted = m_log_prob_est;
+		return;
+	}
+
+	//See Equation 12 of IEEE CTW paper
+	m_log_prob_weighted = WeightHalf + weightAdd(m_log_prob_est, log_prob_children);
+}
+
+// the child off the path is looked up, unless the node is dirty and so
+// has the children's sum. The bit m_history.recent(depth) leads from depth
+// to depth + 1.
+weight_t ContextTree::siblingWeighted(size_t depth, weight_t path_child) const {
+	const CTNode &node = m_nodes[m_path[depth]];
+	if (node.dirty()) return -node.m_log_prob_weighted - path_child;
+	return childWeighted(depth, m_path[depth], !m_history.recent(depth));
+}
+
+// recompute the weighted probability of an internal node on the context
+// path after an update or revert. In lazy mode the node keeps the sum of
+// its children's instead, unless there is nothing to sum.
+weight_t ContextTree::reweighNode(size_t depth, weight_t old_child, weight_t new_child) {
+	CTNode &node = m_nodes[m_path[depth]];
+	weight_t log_children = new_child + siblingWeighted(depth, old_child);
+	if (!m_lazy_weights || log_children >= 0) {
+		node.updateWeighted(log_children);
+		return node.m_log_prob_weighted;
+	}
+
+	node.m_log_prob_weighted = -log_children;
+	return node.logProbWeighted();
+}
+
+// store every dirty weighted probability plainly. Each is worked out from
+// the node alone, but a dirty node's ancestors are all dirty too, so the
+// dirty nodes are found as a subtree hanging off the root, which is walked
+// depth first on an explicit stack. Only internal nodes are ever dirty.
+void ContextTree::refreshWeights(void) {
+	if (m_format == CompactNodes || !m_nodes[m_root].dirty()) return;
+
+	m_refresh_stack.push_back(std::make_pair(size_t(0), m_root));
+	while (!m_refresh_stack.empty()) {
+		size_t depth = m_refresh_stack.back().first;
+		node_index_t idx = m_refresh_stack.back().second;
+		m_refresh_stack.pop_back();
+		m_nodes[idx].m_log_prob_weighted = m_nodes[idx].logProbWeighted();
+		for (int sym = 0; sym < 2; sym++) {
+			node_index_t child = childNode(depth, idx, sym != 0);
+			if (child && m_nodes[child].dirty()) m_refresh_stack.push_back(std::make_pair(depth + 1, child));
+		}
+	}
+}
+
+// weigh updates straight away, or only once something reads the weights
+void ContextTree::setLazyWeights(bool lazy) {
+	refreshWeights();
+	m_lazy_weights = lazy;
+}
+
+// log weighted probability of a child of a node at a depth, a context that
+// has never been visited has probability 1
+weight_t ContextTree::childWeighted(size_t depth, node_index_t idx, symbol_t sym) const {
+	node_index_t child = childNode(depth, idx, sym);
+	return child ? m_nodes[child].logProbWeighted() : 0;
+}
+
+// resolve the context path for the next symbol. The most recent history
+// bit selects the child of the root, the one before it the grandchild and
+// so on, so only the last m_depth bits of the history are ever read.
+template <size_t Depth, NodeFormat Format>
+size_t ContextTree::walkPathFixed(bool create) {
+	const size_t depth = Depth > 0 ? Depth : m_depth;
+	assert(depth == m_depth && Format == m_format);
+	assert(m_history.size() >= depth);
+
+	// only updates are journaled, and only while a savepoint is open
+	bool journal = create && m_savepoints > 0;
+
+	// the context, most recent bit first, unpacked from the history a word
+	// at a time into a stack buffer when the depth is known
+	unsigned char fixed_context[Depth > 0 ? Depth : 1];
+	unsigned char *context = Depth > 0 ? fixed_context : &m_context[0];
+	for (size_t d = 0; d < depth; d += 64) {
+		size_t n = std::min<size_t>(64, depth - d);
+		unsigned long long w = m_history.word(m_history.size() - d - n, n);
+		for (size_t k = 0; k < n; k++) context[d + k] = (w >> (n - 1 - k)) & 1;
+	}
+
+	node_index_t idx = m_root;
+	m_path[0] = idx;
+	m_leaf_depth = depth;
+	m_created_depth = depth + 1;
+
+	for (size_t d = 0; d < depth; d++) {
+		symbol_t sym = context[d];
+		if (journal) journalNode(d, idx);
+		node_index_t *links = Format == CompactNodes ? m_compact.links(idx).child : m_nodes[idx].m_child;
+		if (links[0] == PrunedLeaf) {
+			m_leaf_depth = d;
+			return d + 1;
+		}
+		node_index_t child = links[sym];
+		if (!child) {
+			if (!create) return d + 1;
+			// fill out the tree as we go along, only along the path
+			if (m_created_depth > depth) m_created_depth = d + 1;
+			m_depth_nodes[d + 1]++;
+			if (Format == CompactNodes) {
+				child = d + 1 < depth ? m_compact.allocNode() : m_compact.allocLeaf();
+				m_compact.links(idx).child[sym] = child;
+			} else {
+				child = m_nodes.alloc();
+				m_nodes[idx].m_child[sym] = child;
+			}
+		} else if (create && child < (Format == CompactNodes && d + 1 == depth ? m_shared_leaves : m_shared_nodes)) {
+			// a view updates its own copy of the node
+			child = unshareNode(d + 1, child);
+			if (Format == CompactNodes) {
+				m_compact.links(idx).child[sym] = child;
+			} else {
+				m_nodes[idx].m_child[sym] = child;
+			}
+		}
+		idx = child;
+		m_path[d + 1] = idx;
+	}
+	if (journal) journalNode(depth, idx);
+	return depth + 1;
+}
+
+// walkPath() for hashed trees. Each node on the context path is found by
+// the key of its own context rather than through its parent, so the probes
+// for the whole path are prefetched up front and their cache misses overlap.
+template <size_t Depth>
+size_t ContextTree::walkPathHashed(bool create) {
+	const size_t depth = Depth > 0 ? Depth : m_depth;
+	assert(depth == m_depth && m_format == HashedNodes);
+	assert(m_history.size() >= depth);
+
+	// only updates are journaled, and only while a savepoint is open
+	bool journal = create && m_savepoints > 0;
+
+	hashHistory();
+	for (size_t d = 1; d <= depth; d++) prefetchHashed(hashKey(m_suffix_hash[d]));
+
+	// the context, most recent bit first, as for walkPathFixed()
+	unsigned char fixed_context[Depth > 0 ? Depth : 1];
+	unsigned char *context = Depth > 0 ? fixed_context : &m_context[0];
+	for (size_t d = 0; d < depth; d += 64) {
+		size_t n = std::min<size_t>(64, depth - d);
+		unsigned long long w = m_history.word(m_history.size() - d - n, n);
+		for (size_t k = 0; k < n; k++) context[d + k] = (w >> (n - 1 - k)) & 1;
+	}
+
+	node_index_t idx = m_root;
+	m_path[0] = idx;
+	m_leaf_depth = depth;
+	m_created_depth = depth + 1;
+
+	// the depth of the first node this walk inserted, which, like those
+	// below it, needs no journaling
+	size_t inserted = depth + 1;
+
+	for (size_t d = 0; d < depth; d++) {
+		symbol_t sym = context[d];
+		if (journal && d < inserted) journalNode(d, idx);
+		context_hash_t children = m_nodes[idx].m_key;
+		if (children & HashPruned) {
+			m_leaf_depth = d;
+			return d + 1;
+		}
+		// updates and predictions go on to weigh the sibling
+		if (children & hashChild(!sym)) prefetchHashed(childKey(d, idx, !sym));
+
+		context_hash_t key = hashKey(m_suffix_hash[d + 1]);
+		node_index_t child = children & hashChild(sym) ? findHashed(key, idx) : 0;
+		bool fresh = false;
+		if (!child) {
+			if (!create) return d + 1;
+			// fill out the tree as we go along, only along the path
+			if (m_created_depth > depth) m_created_depth = d + 1;
+			m_depth_nodes[d + 1]++;
+			child = insertHashed(journal ? m_scratch : m_table, key);
+			m_nodes[idx].m_key |= hashChild(sym);
+			fresh = true;
+		} else if (create && child < m_shared_nodes) {
+			// a view updates its own copy of the node
+			child = unshareNode(d + 1, child);
+			fresh = true;
+		}
+		if (fresh && journal) {
+			m_created.push_back(child);
+			if (inserted > depth) inserted = d + 1;
+		}
+		idx = child;
+		m_path[d + 1] = idx;
+	}
+	if (journal && depth < inserted) journalNode(depth, idx);
+	return depth + 1;
+}
+
+// point m_walk_path at the walkPath() instantiation for the depth and node
+// format of the tree. The depths main.cpp configures each have their own,
+// any other depth gets the generic one.
+void ContextTree::selectEngine(void) {
+#define CTW_ENGINE(D) \
+	case D: \
+		m_walk_path = m_format == CompactNodes ? \
+			&ContextTree::walkPathFixed<D, CompactNodes> : \
+			m_format == HashedNodes ? \
+			&ContextTree::walkPathHashed<D> : \
+			&ContextTree::walkPathFixed<D, StandardNodes>; \
+		break;
+
+	switch (m_depth) {
+	CTW_ENGINE(4)
+	CTW_ENGINE(30)
+	CTW_ENGINE(32)
+	CTW_ENGINE(36)
+	CTW_ENGINE(42)
+	CTW_ENGINE(96)
+	default:
+		m_walk_path = m_format == CompactNodes ?
+			&ContextTree::walkPathFixed<0, CompactNodes> :
+			m_format == HashedNodes ?
+			&ContextTree::walkPathHashed<0> :
+			&ContextTree::walkPathFixed<0, StandardNodes>;
+	}
+
+#undef CTW_ENGINE
 }
 
-void CTNode::update(symbol_t sym, int depth, history_t history) {
-	if (depth == 0) {
-		// It's a LEAF!
-		this->m_log_prob_est += this->logKTMul(sym);
-		this->m_count[sym]++;
-		this->m_log_prob_weighted = this->m_log_prob_est;
+// bring the suffix hashes of the context up to date with the history. The
+// common case of one new bit since last time rolls every hash along by it,
+// as the context of depth d is the new bit followed by the old context of
+// depth d - 1. Anything else is recomputed from the history.
+void ContextTree::hashHistory(void) {
+	size_t n = m_history.size();
+	if (m_hash_history == n) return;
+
+	if (m_hash_history + 1 == n) {
+		context_hash_t digit = context_hash_t(m_history.back()) + 1;
+		for (size_t d = m_depth; d > 0; d--) {
+			m_suffix_hash[d] = digit + m_suffix_hash[d - 1] * HashMultiplier;
+		}
 	} else {
-		// fill out the tree as we go along
-		if (NULL == child(0)) {
-			this->m_child[0] = new CTNode();
-			this->m_child[1] = new CTNode();
+		for (size_t d = 1; d <= m_depth; d++) {
+			context_hash_t digit = context_hash_t(m_history.recent(d - 1)) + 1;
+			m_suffix_hash[d] = m_suffix_hash[d - 1] + digit * m_hash_power[d - 1];
 		}
-		symbol_t h = history.back();
-		history.pop_back();
-		this->m_child[h]->update(sym, depth-1, history);
-		// the reason this doesn't use child(h) is because
-		// apparently "child(h)" isn't const
-		this->m_log_prob_est += this->logKTMul(sym);
-		this->m_count[sym]++;
-		
-		//See Equation 12 of IEEE CTW paper
-		//Uses identity log(a+c) = log(a) + log(1+exp(log(c) - log(a))
-		double x = child(0)->logProbWeighted() + child(1)->logProbWeighted();
-		double exponent = x - m_log_prob_est;
-		double y;
-		if (fabs(exponent) < 42.0) {
-			y = log(0.5) + m_log_prob_est + log(1 + exp(exponent));
-		} else {
-			y = log(0.5) + m_log_prob_est + exponent;
+	}
+	m_hash_history = n;
+}
+
+// the key of the child of a hashed node at a depth. Whatever the flags in
+// the node's own key, they never carry into the hash bits.
+context_hash_t ContextTree::childKey(size_t depth, node_index_t idx, symbol_t sym) const {
+	context_hash_t digit = context_hash_t(sym) + 1;
+	return hashKey(m_nodes[idx].m_key + digit * m_hash_power[depth]);
+}
+
+// start pulling the slots a key's probes start from into the cache
+void ContextTree::prefetchHashed(context_hash_t key) const {
+	__builtin_prefetch(&m_nodes[hashSlot(m_table, key)]);
+	for (size_t t = 0; t < m_shared_tables.size(); t++) {
+		__builtin_prefetch(&m_nodes[hashSlot(m_shared_tables[t], key)]);
+	}
+}
+
+// the node with a key, looked for in the tree's own table, the scratch
+// table and then the ones it shares, 0 if there is none. The children of a
+// scratch node are never in the tree's own table.
+node_index_t ContextTree::findHashed(context_hash_t key, node_index_t parent) const {
+	bool scratch = m_scratch.slots > 0;
+	node_index_t idx = 0;
+	if (!scratch || parent < m_scratch.base) idx = probeHashed(m_table, key);
+	if (!idx && scratch) idx = probeHashed(m_scratch, key);
+	for (size_t t = 0; !idx && t < m_shared_tables.size(); t++) {
+		idx = probeHashed(m_shared_tables[t], key);
+	}
+	return idx;
+}
+
+// the node with a key in one table, 0 if there is none
+node_index_t ContextTree::probeHashed(const CTHashTable &table, context_hash_t key) const {
+	size_t mask = table.slots - 1;
+	for (size_t i = hashSlot(table, key) - table.base; ; i = (i + 1) & mask) {
+		context_hash_t slot = m_nodes[node_index_t(table.base + i)].m_key;
+		if ((slot & HashKeyBits) == key) return node_index_t(table.base + i);
+		if (!slot) return 0;
+	}
+}
+
+// put a fresh node with a key the tree doesn't hold yet into the first slot
+// along its probe in a table that has no live node in it
+node_index_t ContextTree::insertHashed(CTHashTable &table, context_hash_t key) {
+	size_t mask = table.slots - 1;
+	size_t i = hashSlot(table, key) - table.base;
+	while (m_nodes[node_index_t(table.base + i)].m_key & HashLive) i = (i + 1) & mask;
+
+	node_index_t idx = node_index_t(table.base + i);
+	if (m_nodes[idx].m_key == HashErased) table.erased--;
+	m_nodes[idx] = CTNode();
+	m_nodes[idx].m_key = key;
+	table.live++;
+	return idx;
+}
+
+// erase a node from the table it is in. Probes only run on past an erased
+// slot to get to the ones after it, so if the next slot is empty this one
+// and any erased ones before it can be emptied too.
+void ContextTree::eraseHashed(node_index_t idx) {
+	CTHashTable &table = m_scratch.slots > 0 && idx >= m_scratch.base ? m_scratch : m_table;
+	size_t mask = table.slots - 1;
+	size_t i = idx - table.base;
+	m_nodes[idx].m_key = HashErased;
+	table.live--;
+	table.erased++;
+	if (m_nodes[node_index_t(table.base + ((i + 1) & mask))].m_key) return;
+
+	while (m_nodes[node_index_t(table.base + i)].m_key == HashErased) {
+		m_nodes[node_index_t(table.base + i)].m_key = 0;
+		table.erased--;
+		i = (i - 1) & mask;
+	}
+}
+
+// make room for some more nodes in the tree's own table, which is kept at
+// most three quarters full, erased slots included, or in the scratch
+// table, which most probes miss and so is kept at most half full. Either
+// is rebuilt half as full as that.
+void ContextTree::reserveHashed(bool scratch, size_t nodes) {
+	const CTHashTable &table = scratch ? m_scratch : m_table;
+	size_t limit = scratch ? table.slots / 2 : table.slots / 4 * 3;
+	if (table.slots > 0 && table.live + table.erased + nodes <= limit) return;
+
+	size_t slots = HashMinSlots;
+	while (slots < (scratch ? 4 : 2) * (table.live + nodes)) slots *= 2;
+	if (scratch) {
+		rehash(0, slots, false);
+	} else {
+		rehash(slots, m_scratch.slots, false);
+	}
+}
+
+// take a table to be the given run of slots, as yet empty
+void ContextTree::setTable(CTHashTable &table, node_index_t base, size_t slots) {
+	assert(slots > 1 && (slots & (slots - 1)) == 0);
+	table.base = base;
+	table.slots = slots;
+	table.shift = 64;
+	for (size_t s = slots; s > 1; s /= 2) table.shift--;
+	table.live = 0;
+	table.erased = 0;
+}
+
+// put a new table at the end of the tree's node arena
+void ContextTree::newTable(CTHashTable &table, size_t slots) {
+	setTable(table, node_index_t(m_nodes.size()), slots);
+	for (size_t i = 0; i < slots; i++) m_nodes.alloc();
+}
+
+// move what the savepoints left in the scratch table into the tree's own
+// table and empty it for the next ones
+void ContextTree::mergeScratch(void) {
+	std::vector<CTNode> nodes;
+	nodes.reserve(m_scratch.live);
+	for (size_t i = 0; i < m_scratch.slots; i++) {
+		CTNode &node = m_nodes[node_index_t(m_scratch.base + i)];
+		if (node.m_key & HashLive) nodes.push_back(node);
+		node.m_key = 0;
+	}
+	m_scratch.live = 0;
+	m_scratch.erased = 0;
+
+	reserveHashed(false, nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++) {
+		node_index_t idx = insertHashed(m_table, nodes[i].m_key & HashKeyBits);
+		m_nodes[idx] = nodes[i];
+	}
+}
+
+// journal a node on the context path before an update changes it. Nodes
+// the update itself allocated are simply released again on undo, hashed
+// walks leave out the ones they inserted themselves.
+void ContextTree::journalNode(size_t depth, node_index_t idx) {
+	const CTJournalFrame &frame = m_frames.back();
+
+	if (m_format != CompactNodes) {
+		if (m_format == StandardNodes && idx >= frame.nodes) return;
+		CTJournalEntry entry = { idx, m_nodes[idx] };
+		m_journal.push_back(entry);
+		return;
+	}
+
+	CTCompactJournalEntry entry = CTCompactJournalEntry();
+	entry.idx = idx;
+	entry.leaf = depth == m_depth;
+	if (entry.leaf) {
+		if (idx >= frame.leaves) return;
+		entry.node.count[0] = m_compact.leaf(idx).count[0];
+		entry.node.count[1] = m_compact.leaf(idx).count[1];
+	} else {
+		if (idx >= frame.nodes) return;
+		entry.node = m_compact.node(idx);
+		entry.links = m_compact.links(idx);
+	}
+	m_compact_journal.push_back(entry);
+}
+
+// undo the most recent journaled update by copying back the nodes it
+// touched and releasing, or erasing, the ones it allocated
+void ContextTree::restoreFrame(void) {
+	const CTJournalFrame &frame = m_frames.back();
+	for (size_t d = frame.created; d <= m_depth; d++) m_depth_nodes[d]--;
+	m_reverts++;
+
+	if (m_format != CompactNodes) {
+		while (m_journal.size() > frame.entries) {
+			const CTJournalEntry &entry = m_journal.back();
+			m_nodes[entry.idx] = entry.node;
+			m_journal.pop_back();
+		}
+		if (m_format == StandardNodes) {
+			m_nodes.truncate(frame.nodes);
+		} else while (m_created.size() > frame.nodes) {
+			eraseHashed(m_created.back());
+			m_created.pop_back();
+		}
+	} else {
+		while (m_compact_journal.size() > frame.entries) {
+			const CTCompactJournalEntry &entry = m_compact_journal.back();
+			if (entry.leaf) {
+				m_compact.leaf(entry.idx).count[0] = entry.node.count[0];
+				m_compact.leaf(entry.idx).count[1] = entry.node.count[1];
+			} else {
+				m_compact.node(entry.idx) = entry.node;
+				m_compact.links(entry.idx) = entry.links;
+			}
+			m_compact_journal.pop_back();
 		}
-		this->m_log_prob_weighted = y;
-		history.push_back(h);
+		m_compact.truncate(frame.nodes, frame.leaves);
+		m_log_block_prob = frame.log_block_prob;
 	}
+
+	m_frames.pop_back();
 }
 
 void ContextTree::update(symbol_t sym) {
@@ -166,8 +938,59 @@ void ContextTree::update(symbol_t sym) {
 		m_history.push_back(sym);
 		return;
 	}
-	m_root->update(sym, m_depth, m_history);
+
+	// a rebuilt table moves nodes, so make room before there's a path
+	if (m_format == HashedNodes) reserveHashed(m_savepoints > 0, m_depth);
+
+	if (m_savepoints > 0) {
+		CTJournalFrame frame;
+		frame.entries = m_format == CompactNodes ? m_compact_journal.size() : m_journal.size();
+		if (m_format == StandardNodes) {
+			frame.nodes = m_nodes.size();
+		} else {
+			frame.nodes = m_format == HashedNodes ? m_created.size() : m_compact.nodes();
+		}
+		frame.leaves = m_compact.leaves();
+		frame.log_block_prob = m_log_block_prob;
+		m_frames.push_back(frame);
+	}
+
+	walkPath(true);
+	if (m_savepoints > 0) m_frames.back().created = m_created_depth;
+	m_updates++;
+	m_path_nodes += std::min(m_created_depth, m_leaf_depth + 1);
+
+	if (m_format == CompactNodes) {
+		updateCompact(sym);
+	} else {
+		// update the estimators from the leaf back up to the root, so that
+		// every node sees the old and new weighted probabilities of its
+		// child on the path
+		pathLogKT(sym, 0, m_leaf_depth + 1);
+		CTNode &leaf = m_nodes[m_path[m_leaf_depth]];
+		weight_t old_weighted = leaf.m_log_prob_weighted;
+		leaf.m_log_prob_est += m_path_log_kt[m_leaf_depth];
+		leaf.m_count[sym]++;
+		leaf.m_log_prob_weighted = leaf.m_log_prob_est;
+		weight_t weighted = leaf.m_log_prob_weighted;
+
+		for (size_t d = m_leaf_depth; d-- > 0; ) {
+			CTNode &node = m_nodes[m_path[d]];
+			weight_t old_node = node.logProbWeighted();
+			node.m_log_prob_est += m_path_log_kt[d];
+			node.m_count[sym]++;
+			weighted = reweighNode(d, old_weighted, weighted);
+			old_weighted = old_node;
+		}
+	}
+
 	m_history.push_back(sym); // add the new symbol to the history
+
+	// keep within the node budget. The journal refers to nodes by index, so
+	// while savepoints are open the tree may run over until they are closed.
+	if (m_max_nodes > 0 && m_savepoints == 0 && size() > m_max_nodes) {
+		prune(m_max_nodes - m_max_nodes / 4);
+	}
 }
 
 
@@ -179,52 +1002,136 @@ void ContextTree::update(const symbol_list_t &symlist) {
 
 
 // updates the history statistics, without touching the context tree
+void ContextTree::updateHistory(symbol_t sym) {
+	m_history.push_back(sym);
+}
+
 void ContextTree::updateHistory(const symbol_list_t &symlist) {
 	for (size_t i=0; i < symlist.size(); i++) {
 		m_history.push_back(symlist[i]);
 	}
 }
 
-// internal routine to remove a single symbol from the context tree
-void CTNode::revert(symbol_t sym, int depth, history_t history) {
-	if (depth == 0) {
-		this->m_count[sym]--;
-		this->m_log_prob_est -= this->logKTMul(sym);
-		this->m_log_prob_weighted = this->m_log_prob_est;
-	} else {
-		// no need to delete nodes just yet
-		symbol_t h = history.back();
-		history.pop_back();
-		this->m_child[h]->revert(sym, depth-1, history);
-		this->m_count[sym]--;
-		this->m_log_prob_est -= this->logKTMul(sym);
-		// If there's nothing under us then we're a leaf again
-		if (!child(0)->visits() && !child(1)->visits()) {
-			this->m_log_prob_weighted = this->m_log_prob_est;
-		} else {
-			double x = child(0)->logProbWeighted() + child(1)->logProbWeighted();
-			double exponent = x - m_log_prob_est;
-			double y;
-			if (fabs(exponent) < 42.0) {
-				y = log(0.5) + m_log_prob_est + log(1 + exp(exponent));
-			} else {
-				y = log(0.5) + m_log_prob_est + exponent;
-			}
-			this->m_log_prob_weighted = y;
-		}
-		history.push_back(h);
+// removes the most recently observed symbol from the context tree
+void ContextTree::revert(void) {
+	symbol_t sym = m_history.back();
+	m_history.pop_back();
+	if (m_hash_history > m_history.size()) m_hash_history = HashStale;
+	if (m_history.size() < m_depth) return;
+
+	// journaled updates are undone exactly
+	if (!m_frames.empty()) {
+		restoreFrame();
+		return;
+	}
+
+	// no need to delete nodes just yet, but a view may copy the path
+	m_reverts++;
+	if (m_format == HashedNodes && isView()) reserveHashed(false, m_depth);
+	size_t found = walkPath(false);
+	assert(found == m_leaf_depth + 1);
+	if (isView()) unsharePath();
+
+	if (m_format == CompactNodes) {
+		revertCompact(sym);
+		return;
+	}
+
+	pathLogKT(sym, 1, m_leaf_depth + 1);
+	CTNode &leaf = m_nodes[m_path[m_leaf_depth]];
+	weight_t old_weighted = leaf.m_log_prob_weighted;
+	leaf.m_count[sym]--;
+	leaf.m_log_prob_est -= m_path_log_kt[m_leaf_depth];
+	leaf.m_log_prob_weighted = leaf.m_log_prob_est;
+	weight_t weighted = leaf.m_log_prob_weighted;
+
+	for (size_t d = m_leaf_depth; d-- > 0; ) {
+		CTNode &node = m_nodes[m_path[d]];
+		weight_t old_node = node.logProbWeighted();
+		node.m_count[sym]--;
+		node.m_log_prob_est -= m_path_log_kt[d];
+		weighted = reweighNode(d, old_weighted, weighted);
+		old_weighted = old_node;
 	}
 }
 
 
+// update the compact nodes on the current context path. The conditional
+// probability of the symbol is carried up from the leaf: at each node it is
+// Pw(x) = (beta * Pe(x) + Pw_child(x)) / (beta + 1), and the ratio becomes
+// beta * Pe(x) / Pw_child(x). Siblings off the path never need to be read.
+void ContextTree::updateCompact(symbol_t sym) {
+	pathLogKT(sym, 0, m_leaf_depth + 1);
+	compact_count_t *leaf = compactLeafCounts();
+	double log_prob = weightToLog(m_path_log_kt[m_leaf_depth]);
+	compactCount(leaf, sym);
 
-// removes the most recently observed symbol from the context tree
-void ContextTree::revert(void) {
-	symbol_t sym = m_history.back();
-	m_history.pop_back();
-	if (m_history.size() >= m_depth) {
-		m_root->revert(sym, m_depth, m_history);
+	for (size_t d = m_leaf_depth; d-- > 0; ) {
+		CTCompactNode &node = m_compact.node(m_path[d]);
+		double log_est = weightToLog(m_path_log_kt[d]);
+		double log_beta = node.log_beta;
+		node.log_beta = clampLogBeta(log_beta + log_est - log_prob);
+		compactCount(node.count, sym);
+		log_prob = logAdd(log_beta + log_est, log_prob) - log1pExp(log_beta);
+	}
+
+	m_log_block_prob += log_prob;
+}
+
+// inverse of updateCompact, for a path already resolved by walkPath
+void ContextTree::revertCompact(symbol_t sym) {
+	pathLogKT(sym, 1, m_leaf_depth + 1);
+	compact_count_t *leaf = compactLeafCounts();
+	compactUncount(leaf, sym);
+	double log_prob = weightToLog(m_path_log_kt[m_leaf_depth]);
+
+	for (size_t d = m_leaf_depth; d-- > 0; ) {
+		CTCompactNode &node = m_compact.node(m_path[d]);
+		compactUncount(node.count, sym);
+		double log_est = weightToLog(m_path_log_kt[d]);
+		double log_beta = clampLogBeta(node.log_beta + log_prob - log_est);
+		node.log_beta = float(log_beta);
+		log_prob = logAdd(log_beta + log_est, log_prob) - log1pExp(log_beta);
+	}
+
+	m_log_block_prob -= log_prob;
+}
+
+
+// counts of the last node on a complete compact context path, which is
+// either a leaf or an internal node that has been pruned into one
+compact_count_t *ContextTree::compactLeafCounts(void) {
+	node_index_t idx = m_path[m_leaf_depth];
+	if (m_leaf_depth == m_depth) return m_compact.leaf(idx).count;
+	return m_compact.node(idx).count;
+}
+
+
+// the KT multipliers for sym of the first n nodes on the context path, into
+// m_path_log_kt. The counts are copied out into contiguous per-depth arrays
+// first so that logKTBatch can work through the whole path at once. With
+// undo set the multipliers are those a revert takes back out.
+void ContextTree::pathLogKT(symbol_t sym, count_t undo, size_t n) {
+	for (size_t d = 0; d < n; d++) {
+		node_index_t idx = m_path[d];
+		count_t a, b;
+		if (m_format != CompactNodes) {
+			a = m_nodes[idx].m_count[sym];
+			b = m_nodes[idx].m_count[!sym];
+		} else {
+			const compact_count_t *count = d == m_depth ?
+				m_compact.leaf(idx).count : m_compact.node(idx).count;
+			a = count[sym];
+			b = count[!sym];
+		}
+		m_path_count[d] = a >= undo ? a - undo : 0;
+		m_path_other[d] = b;
 	}
+#ifdef CTW_FIXED_POINT
+	for (size_t d = 0; d < n; d++) m_path_log_kt[d] = weightKT(m_path_count[d], m_path_other[d]);
+#else
+	logKTBatch(&m_path_count[0], &m_path_other[0], &m_path_log_kt[0], n);
+#endif
 }
 
 
@@ -232,6 +1139,38 @@ void ContextTree::revert(void) {
 void ContextTree::revertHistory(size_t newsize) {
 	assert(newsize <= m_history.size());
 	while (m_history.size() > newsize) m_history.pop_back();
+	if (m_hash_history > newsize) m_hash_history = HashStale;
+}
+
+
+// open a savepoint, journaling every update from here on
+CTSavepoint ContextTree::savepoint(void) {
+	m_savepoints++;
+	m_history.pin();
+	CTSavepoint sp = { m_frames.size(), m_history.size() };
+	return sp;
+}
+
+// undo every update and history change made since the savepoint
+void ContextTree::rollback(const CTSavepoint &sp) {
+	assert(m_savepoints > 0);
+	assert(m_frames.size() >= sp.frames);
+
+	while (m_frames.size() > sp.frames) restoreFrame();
+	revertHistory(sp.history);
+}
+
+// close the most recently opened savepoint
+void ContextTree::release(void) {
+	assert(m_savepoints > 0);
+	m_history.unpin();
+	if (--m_savepoints > 0) return;
+
+	m_journal.clear();
+	m_compact_journal.clear();
+	m_frames.clear();
+	m_created.clear();
+	if (m_scratch.live + m_scratch.erased > 0) mergeScratch();
 }
 
 
@@ -239,24 +1178,133 @@ void ContextTree::revertHistory(size_t newsize) {
 // generate a specified number of random symbols
 // distributed according to the context tree statistics
 void ContextTree::genRandomSymbols(symbol_list_t &symbols, size_t bits) {
+	CTSavepoint sp = savepoint();
 	genRandomSymbolsAndUpdate(symbols, bits);
 	// restore the context tree to its original state
-	for (size_t i=0; i < bits; i++) revert();
+	rollback(sp);
+	release();
 }
 
-// guess the next symbol based on our probabilities
+// the probability that the very next symbol is sym, given the history.
+// The current context path is walked once and the tree is left untouched:
+// the estimators and weighted probabilities the path would have after an
+// update are computed on the side, from the leaf up. Nodes past the end of
+// the existing path are contexts that have never been seen.
+double ContextTree::predict(symbol_t sym) {
+	// If we don't have enough history then just guess uniformly
+	m_predictions++;
+	if (m_history.size() < m_depth) return 0.5;
+
+	size_t found = walkPath(false);
+	const weight_t log_kt_unseen = weightKT(0, 0);
+	pathLogKT(sym, 0, std::min(found, m_leaf_depth + 1));
+
+	if (m_format == CompactNodes) {
+		double log_prob = weightToLog(log_kt_unseen);
+		if (found > m_leaf_depth) log_prob = weightToLog(m_path_log_kt[m_leaf_depth]);
+		for (size_t d = m_leaf_depth; d-- > 0; ) {
+			if (d >= found) {
+				// an unseen node has beta = 1
+				log_prob = LogHalf + logAdd(weightToLog(log_kt_unseen), log_prob);
+				continue;
+			}
+			const CTCompactNode &node = m_compact.node(m_path[d]);
+			double log_est = weightToLog(m_path_log_kt[d]);
+			double log_beta = node.log_beta;
+			log_prob = logAdd(log_beta + log_est, log_prob) - log1pExp(log_beta);
+		}
+		return exp(log_prob);
+	}
+
+	// the weighted probability of the path child as it is, for dirty nodes
+	// to tell that of the child off the path by
+	weight_t log_weighted = log_kt_unseen, old_weighted = 0;
+	if (found > m_leaf_depth) {
+		const CTNode &leaf = m_nodes[m_path[m_leaf_depth]];
+		log_weighted = leaf.m_log_prob_est + m_path_log_kt[m_leaf_depth];
+		old_weighted = leaf.m_log_prob_weighted;
+	}
+	for (size_t d = m_leaf_depth; d-- > 0; ) {
+		if (d >= found) {
+			log_weighted = WeightHalf + weightAdd(log_kt_unseen, log_weighted);
+			continue;
+		}
+		const CTNode &node = m_nodes[m_path[d]];
+		weight_t log_est = node.m_log_prob_est + m_path_log_kt[d];
+		weight_t log_children = log_weighted + siblingWeighted(d, old_weighted);
+		log_weighted = WeightHalf + weightAdd(log_est, log_children);
+		old_weighted = node.logProbWeighted();
+	}
+	// by now that is the root's
+	return exp(weightToLog(log_weighted - old_weighted));
+}
+
+// the probability of observing a sequence of symbols next. The sequence
+// is run through the tree under a savepoint and the joint probability read
+// off the root, after which the journal puts every node back exactly.
+double ContextTree::predict(const symbol_list_t &symlist) {
+	m_predictions++;
+	CTSavepoint sp = savepoint();
+
+	double log_prob = -logBlockProbability();
+	for (size_t i = 0; i < symlist.size(); i++) {
+		// symbols that only fill out the pre-history are guessed uniformly
+		if (m_history.size() < m_depth) log_prob += LogHalf;
+		update(symlist[i]);
+	}
+	log_prob += logBlockProbability();
+
+	rollback(sp);
+	release();
+	return exp(log_prob);
+}
+
+// the probability of every sequence of the given number of bits. The
+// sequences are enumerated as a binary trie, depth first, so each prefix
+// is pushed through the tree once and shared by every sequence below it.
+void ContextTree::predictDistribution(size_t bits, std::vector<double> &dist) {
+	assert(bits <= MaxDistributionBits);
+	dist.assign(size_t(1) << bits, 0.0);
+	m_predictions++;
+
+	CTSavepoint sp = savepoint();
+	distributionNode(0, bits, 0, -logBlockProbability(), dist);
+	rollback(sp);
+	release();
+}
+
+// one level of the trie traversal: log_prob is minus the block probability
+// before the sequence, plus any uniform pre-history guesses so far
+void ContextTree::distributionNode(size_t bit, size_t bits, size_t prefix,
+	double log_prob, std::vector<double> &dist) {
+
+	if (bit == bits) {
+		dist[prefix] = exp(log_prob + logBlockProbability());
+		return;
+	}
+
+	for (int sym = 0; sym < 2; sym++) {
+		double log_prob_sym = log_prob;
+		if (m_history.size() < m_depth) log_prob_sym += LogHalf;
+		update(sym != 0);
+		distributionNode(bit + 1, bits, prefix | (size_t(sym) << bit), log_prob_sym, dist);
+		revert();
+	}
+}
+
+// guess the next symbol based on our probabilities
 symbol_t ContextTree::predictNext() {
+	return rand01() < nextProbability();
+}
+
+// the probability that predictNext() guesses a 1
+double ContextTree::nextProbability(void) {
 	// (via discussion with Mayank)
 	// If we don't have enough history then just guess uniformly
 	if (historySize() < depth()) {
-		return (rand01() < 0.5);
+		return 0.5;
 	}
-	double pr_h = logBlockProbability();
-	update(1);
-	double pr_h1 = logBlockProbability();
-	revert();
-	assert(fabs(logBlockProbability() - pr_h) < 0.0001);
-	return rand01() < exp(pr_h1 - pr_h);
+	return predict(true);
 }
 
 // generate a specified number of random symbols distributed according to
@@ -275,11 +1323,730 @@ void ContextTree::genRandomSymbolsAndUpdate(symbol_list_t &symbols, size_t bits)
 
 // the logarithm of the block probability of the whole sequence
 double ContextTree::logBlockProbability(void) {
-	return m_root->logProbWeighted();
+	if (m_format == CompactNodes) return m_log_block_prob;
+	refreshWeights();
+	return weightToLog(m_nodes[m_root].logProbWeighted());
 }
 
 
 // get the n'th most recent history symbol, NULL if doesn't exist
 const symbol_t *ContextTree::nthHistorySymbol(size_t n) const {
-	return n < m_history.size() ? &m_history[n] : NULL;
+	static const symbol_t symbols[2] = { false, true };
+	if (n >= m_history.size() || n < m_history.size() - m_history.resident()) return NULL;
+	return &symbols[m_history[n]];
+}
+
+
+// how many history symbols beyond the context are kept resident
+void ContextTree::setHistoryWindow(size_t symbols) {
+	m_history.setWindow(m_depth + symbols);
+}
+
+
+// log ratio of estimated to children's probability past which a node's
+// children add so little to the mixture that it is pruned first
+static const double PruneDominance = 5.0;
+
+// marks a node not kept by prune() in the remap tables
+static const node_index_t PruneDropped = ~node_index_t(0);
+
+// whether a node ends every context path through it: a leaf at full depth,
+// or an internal node that has been pruned into one
+bool ContextTree::isLeaf(size_t depth, node_index_t idx) const {
+	if (depth == m_depth) return true;
+	if (m_format == CompactNodes) return m_compact.links(idx).child[0] == PrunedLeaf;
+	if (m_format == HashedNodes) return (m_nodes[idx].m_key & HashPruned) != 0;
+	return m_nodes[idx].m_child[0] == PrunedLeaf;
+}
+
+// child of an internal node, 0 if missing
+node_index_t ContextTree::childNode(size_t depth, node_index_t idx, symbol_t sym) const {
+	if (m_format == CompactNodes) return m_compact.links(idx).child[sym];
+	if (m_format == HashedNodes) {
+		if (!(m_nodes[idx].m_key & hashChild(sym))) return 0;
+		return findHashed(childKey(depth, idx, sym), idx);
+	}
+	return m_nodes[idx].m_child[sym];
+}
+
+// child link of an internal node of a tree that has links, 0 if missing
+node_index_t &ContextTree::childLink(node_index_t idx, symbol_t sym) {
+	if (m_format == CompactNodes) return m_compact.links(idx).child[sym];
+	return m_nodes[idx].m_child[sym];
+}
+
+// whether a node belongs to the tree a view shares
+bool ContextTree::isShared(size_t depth, node_index_t idx) const {
+	if (m_format == CompactNodes && depth == m_depth) return idx < m_shared_leaves;
+	return idx < m_shared_nodes;
+}
+
+// copy a shared node into the view's own arena, returning the copy's index.
+// A hashed view keeps its copies but for the root in its own table, or the
+// scratch one while a journaled update is under way.
+node_index_t ContextTree::unshareNode(size_t depth, node_index_t idx) {
+	node_index_t copy;
+	if (m_format != CompactNodes) {
+		if (m_format == HashedNodes && depth > 0) {
+			CTHashTable &table = m_frames.empty() ? m_table : m_scratch;
+			copy = insertHashed(table, m_nodes[idx].m_key & HashKeyBits);
+		} else {
+			copy = m_nodes.alloc();
+		}
+		m_nodes[copy] = m_nodes[idx];
+	} else if (depth == m_depth) {
+		copy = m_compact.allocLeaf();
+		m_compact.leaf(copy) = m_compact.leaf(idx);
+	} else {
+		copy = m_compact.allocNode();
+		m_compact.node(copy) = m_compact.node(idx);
+		m_compact.links(copy) = m_compact.links(idx);
+	}
+	return copy;
+}
+
+// copy every shared node on the context path, relinking its parent to the
+// copy, before a view writes to them. The bit m_history.recent(d) leads
+// from depth d to d + 1. Hashed copies are found without a link.
+void ContextTree::unsharePath(void) {
+	for (size_t d = 1; d <= m_leaf_depth; d++) {
+		if (!isShared(d, m_path[d])) continue;
+		m_path[d] = unshareNode(d, m_path[d]);
+		if (m_format != HashedNodes) childLink(m_path[d - 1], m_history.recent(d - 1)) = m_path[d];
+	}
+}
+
+// how much an internal node's children are worth keeping: the number of
+// visits to it, or 0 if its estimator dominates them anyway
+count_t ContextTree::pruneScore(size_t depth, node_index_t idx) const {
+	if (m_format == CompactNodes) {
+		const CTCompactNode &node = m_compact.node(idx);
+		if (node.log_beta > PruneDominance) return 0;
+		return count_t(node.count[0]) + node.count[1];
+	}
+
+	const CTNode &node = m_nodes[idx];
+	weight_t log_children = childWeighted(depth, idx, false) + childWeighted(depth, idx, true);
+	if (weightToLog(node.m_log_prob_est - log_children) > PruneDominance) return 0;
+	return node.visits();
+}
+
+// set the size of the node budget, 0 for none. The tree is pruned back
+// down on the next update if it is over.
+void ContextTree::setMaxNodes(size_t nodes) {
+	m_max_nodes = nodes;
+}
+
+// evict the least useful subtrees until at most the given number of nodes
+// remain. Each evicted subtree's parent becomes a permanent leaf: its own
+// counts already sum up everything seen below it, so from then on its
+// weighted probability is just its estimate. The survivors are moved down
+// to the front of the arena, so no free list is needed and size() stays
+// the live node count. Those of a hashed tree move into a smaller table.
+void ContextTree::prune(size_t nodes) {
+	assert(m_savepoints == 0 && !isView());
+	if (size() <= nodes) return;
+	refreshWeights();
+
+	// a node survives a threshold if every internal node between it and
+	// the root scores above it, so find the lowest threshold that leaves
+	// no more than the budget
+	std::vector<count_t> limits;
+	limits.reserve(size());
+	pruneLimits(0, Root, std::numeric_limits<count_t>::max(), limits);
+	size_t drop = limits.size() - nodes;
+	std::nth_element(limits.begin(), limits.begin() + (drop - 1), limits.end());
+	count_t threshold = limits[drop - 1];
+	if (threshold == std::numeric_limits<count_t>::max()) return; // nothing below the root to evict
+
+	m_node_remap.assign(m_format == CompactNodes ? m_compact.nodes() : m_nodes.size(), PruneDropped);
+	m_leaf_remap.assign(m_compact.leaves(), PruneDropped);
+	double log_delta = 0.0;
+	pruneNode(0, Root, threshold, log_delta);
+	m_log_block_prob += log_delta;
+
+	// number the survivors in arena order, so nothing moves up
+	size_t kept_nodes = 0, kept_leaves = 0;
+	for (size_t i = 0; i < m_node_remap.size(); i++) {
+		if (m_node_remap[i] != PruneDropped) m_node_remap[i] = node_index_t(kept_nodes++);
+	}
+	if (m_format == CompactNodes) {
+		m_leaf_remap[0] = 0; // reserved
+		for (size_t i = 0; i < m_leaf_remap.size(); i++) {
+			if (m_leaf_remap[i] != PruneDropped) m_leaf_remap[i] = node_index_t(kept_leaves++);
+		}
+	}
+
+	if (m_format == HashedNodes) {
+		size_t slots = HashMinSlots;
+		while (slots < 2 * (kept_nodes + m_depth)) slots *= 2;
+		rehash(slots, 0, true);
+		countNodes();
+		return;
+	}
+
+	pruneRelink(0, Root);
+
+	for (size_t i = 0; i < m_node_remap.size(); i++) {
+		node_index_t to = m_node_remap[i];
+		if (to == PruneDropped || to == i) continue;
+		if (m_format == CompactNodes) {
+			m_compact.node(to) = m_compact.node(node_index_t(i));
+			m_compact.links(to) = m_compact.links(node_index_t(i));
+		} else {
+			m_nodes[to] = m_nodes[node_index_t(i)];
+		}
+	}
+	for (size_t i = 0; i < m_leaf_remap.size(); i++) {
+		node_index_t to = m_leaf_remap[i];
+		if (to == PruneDropped || to == i) continue;
+		m_compact.leaf(to) = m_compact.leaf(node_index_t(i));
+	}
+
+	if (m_format == CompactNodes) {
+		m_compact.truncate(kept_nodes, kept_leaves);
+	} else {
+		m_nodes.truncate(kept_nodes);
+	}
+
+	// the survivors have moved
+	countNodes();
+}
+
+// record, for a node and everything below it, the lowest score of the
+// internal nodes between it and the root
+void ContextTree::pruneLimits(size_t depth, node_index_t idx, count_t limit,
+	std::vector<count_t> &limits) const {
+
+	limits.push_back(limit);
+	if (isLeaf(depth, idx)) return;
+
+	if (depth > 0) limit = std::min(limit, pruneScore(depth, idx));
+	for (int sym = 0; sym < 2; sym++) {
+		node_index_t child = childNode(depth, idx, sym != 0);
+		if (child) pruneLimits(depth + 1, child, limit, limits);
+	}
+}
+
+// mark the nodes that survive a threshold, turning the lowest scoring
+// internal ones into leaves. Weighted probabilities are recomputed on the
+// way back up wherever something below changed, log_delta returns the
+// change in the node's log weighted probability for compact trees.
+bool ContextTree::pruneNode(size_t depth, node_index_t idx, count_t threshold,
+	double &log_delta) {
+
+	bool leaf_array = m_format == CompactNodes && depth == m_depth;
+	(leaf_array ? m_leaf_remap : m_node_remap)[idx] = 0;
+	log_delta = 0.0;
+	if (isLeaf(depth, idx)) return false;
+
+	if (depth > 0 && pruneScore(depth, idx) <= threshold) {
+		if (m_format == CompactNodes) {
+			// Pw = Pe * (1 + 1 / beta) / 2 becomes Pe
+			CTCompactNode &node = m_compact.node(idx);
+			log_delta = -LogHalf - log1pExp(-node.log_beta);
+			node.log_beta = float(CompactLogBetaMax);
+		} else {
+			CTNode &node = m_nodes[idx];
+			node.m_log_prob_weighted = node.m_log_prob_est;
+		}
+		if (m_format == HashedNodes) {
+			m_nodes[idx].m_key |= HashPruned;
+		} else {
+			childLink(idx, false) = PrunedLeaf;
+			childLink(idx, true) = PrunedLeaf;
+		}
+		return true;
+	}
+
+	bool changed = false;
+	double log_delta_children = 0.0;
+	for (int sym = 0; sym < 2; sym++) {
+		node_index_t child = childNode(depth, idx, sym != 0);
+		double log_delta_child;
+		if (child && pruneNode(depth + 1, child, threshold, log_delta_child)) {
+			changed = true;
+			log_delta_children += log_delta_child;
+		}
+	}
+	if (!changed) return false;
+
+	if (m_format == CompactNodes) {
+		// scaling Pw0 * Pw1 by delta scales Pw by (beta + delta) / (beta + 1)
+		CTCompactNode &node = m_compact.node(idx);
+		double log_beta = node.log_beta;
+		node.log_beta = clampLogBeta(log_beta - log_delta_children);
+		log_delta = logAdd(log_beta, log_delta_children) - log1pExp(log_beta);
+	} else {
+		CTNode &node = m_nodes[idx];
+		node.updateWeighted(childWeighted(depth, idx, false) + childWeighted(depth, idx, true));
+	}
+	return true;
+}
+
+// point the child links of the surviving nodes at their new indices
+void ContextTree::pruneRelink(size_t depth, node_index_t idx) {
+	if (isLeaf(depth, idx)) return;
+
+	for (int sym = 0; sym < 2; sym++) {
+		node_index_t &child = childLink(idx, sym != 0);
+		if (!child) continue;
+		pruneRelink(depth + 1, child);
+		bool leaf_array = m_format == CompactNodes && depth + 1 == m_depth;
+		child = (leaf_array ? m_leaf_remap : m_node_remap)[child];
+	}
+}
+
+// move the nodes of a hashed tree's tables into fresh ones of the given
+// numbers of slots, which drops every erased slot, leaving out those prune()
+// dropped, and point the undo journal at where the nodes went. The scratch
+// table follows the tree's own one in the arena, so rebuilding that means
+// rebuilding both; an own table of 0 slots leaves it be, and a scratch
+// table of 0 slots is none.
+void ContextTree::rehash(size_t slots, size_t scratch_slots, bool pruned) {
+	node_index_t base = slots > 0 ? m_table.base : node_index_t(m_nodes.size());
+	if (slots == 0 && m_scratch.slots > 0) base = m_scratch.base;
+	node_index_t scratch_base = m_scratch.slots > 0 ? m_scratch.base : node_index_t(m_nodes.size());
+	size_t end = m_nodes.size();
+
+	std::vector<CTJournalEntry> nodes;
+	nodes.reserve((slots > 0 ? m_table.live : 0) + m_scratch.live);
+	for (size_t i = base; i < end; i++) {
+		node_index_t idx = node_index_t(i);
+		if (!(m_nodes[idx].m_key & HashLive)) continue;
+		if (pruned && m_node_remap[idx] == PruneDropped) continue;
+		CTJournalEntry entry = { idx, m_nodes[idx] };
+		nodes.push_back(entry);
+	}
+
+	m_nodes.truncate(base);
+	if (slots > 0) newTable(m_table, slots);
+	m_scratch = CTHashTable();
+	if (scratch_slots > 0) newTable(m_scratch, scratch_slots);
+	std::vector<node_index_t> remap(end - base, 0);
+	for (size_t i = 0; i < nodes.size(); i++) {
+		CTHashTable &table = nodes[i].idx >= scratch_base ? m_scratch : m_table;
+		node_index_t idx = insertHashed(table, nodes[i].node.m_key & HashKeyBits);
+		m_nodes[idx] = nodes[i].node;
+		remap[nodes[i].idx - base] = idx;
+	}
+
+	for (size_t i = 0; i < m_journal.size(); i++) {
+		node_index_t &idx = m_journal[i].idx;
+		if (idx >= base) idx = remap[idx - base];
+	}
+	for (size_t i = 0; i < m_created.size(); i++) {
+		node_index_t &idx = m_created[i];
+		if (idx >= base) idx = remap[idx - base];
+	}
+}
+
+
+// what a checkpoint records about a context tree ahead of its arrays
+struct CTCheckpointRecord {
+	unsigned long long depth;
+	unsigned long long format;
+	unsigned long long nodes;	// standard nodes, or compact internal nodes
+	unsigned long long leaves;	// compact leaves
+	double log_block_prob;
+};
+
+// write the tree and its history to a checkpoint
+void ContextTree::save(CheckpointWriter &out) {
+	assert(m_savepoints == 0 && !isView());
+	refreshWeights();
+
+	// a hashed tree's arena ends with its own table, without the scratch
+	// one, which is empty between savepoints anyway
+	if (m_scratch.slots > 0) {
+		m_nodes.truncate(m_scratch.base);
+		m_scratch = CTHashTable();
+	}
+
+	CTCheckpointRecord record;
+	record.depth = m_depth;
+	record.format = m_format;
+	record.nodes = m_format == CompactNodes ? m_compact.nodes() : m_nodes.size();
+	record.leaves = m_format == CompactNodes ? m_compact.leaves() : 0;
+	record.log_block_prob = m_log_block_prob;
+	out.write(&record, sizeof(record));
+
+	m_history.save(out);
+
+	if (m_format == CompactNodes) {
+		m_compact.save(out);
+	} else {
+		m_nodes.save(out);
+	}
+}
+
+// read the tree and its history back from a checkpoint
+bool ContextTree::load(CheckpointReader &in) {
+	assert(m_savepoints == 0);
+	clear();
+
+	CTCheckpointRecord record;
+	if (!in.read(&record, sizeof(record))) return false;
+	if (record.depth != m_depth || record.format != (unsigned long long)m_format) return false;
+
+	bool ok = m_history.load(in) && (m_format == CompactNodes ?
+		m_compact.load(in, record.nodes, record.leaves) :
+		m_nodes.load(in, record.nodes));
+	if (ok && m_format == HashedNodes) {
+		// a hashed tree's table is every slot past the root
+		size_t slots = size_t(record.nodes) - 1;
+		ok = slots >= HashMinSlots && (slots & (slots - 1)) == 0;
+		if (ok) setTable(m_table, Root + 1, slots);
+		for (size_t i = 0; ok && i < slots; i++) {
+			context_hash_t key = m_nodes[node_index_t(Root + 1 + i)].m_key;
+			if (key & HashLive) m_table.live++;
+			if (key == HashErased) m_table.erased++;
+		}
+	}
+	if (!ok) {
+		clear();
+		return false;
+	}
+
+	m_log_block_prob = record.log_block_prob;
+	countNodes();
+	return true;
+}
+
+
+// create factors context trees of the given depth
+FactoredContextTree::FactoredContextTree(size_t depth, NodeFormat format,
+	size_t factors, size_t threads) :
+	m_pool(new WorkerPool(threads)),
+	m_task_symbols(NULL),
+	m_task_bits(0)
+{
+	assert(factors > 0);
+	for (size_t i = 0; i < factors; i++) {
+		m_trees.push_back(new ContextTree(depth, format));
+	}
+}
+
+// create a factored context tree from another factored context tree
+FactoredContextTree::FactoredContextTree(const FactoredContextTree &fct, TreeCopy copy) :
+	m_pool(new WorkerPool(copy == SharedView ? 1 : fct.m_pool->threads())),
+	m_task_symbols(NULL),
+	m_task_bits(0)
+{
+	assert(fct.m_savepoints.empty());
+	for (size_t i = 0; i < fct.m_trees.size(); i++) {
+		m_trees.push_back(new ContextTree(*fct.m_trees[i], copy));
+	}
+}
+
+FactoredContextTree::~FactoredContextTree(void) {
+	delete m_pool;
+	for (size_t i = 0; i < m_trees.size(); i++) delete m_trees[i];
+}
+
+
+// clear every tree
+void FactoredContextTree::clear(void) {
+	for (size_t i = 0; i < m_trees.size(); i++) m_trees[i]->clear();
+	m_savepoints.clear();
+}
+
+
+// update each tree with its own bits of a symbol sequence
+void FactoredContextTree::update(const symbol_list_t &symlist) {
+	if (m_trees.size() == 1) {
+		m_trees[0]->update(symlist);
+		return;
+	}
+
+	m_task_symbols = &symlist;
+	m_pool->run(m_trees.size(), updateTask, this);
+}
+
+// train tree with its bits of the task symbols, the rest only go into its history
+void FactoredContextTree::updateTask(void *context, size_t tree) {
+	FactoredContextTree &fct = *static_cast<FactoredContextTree *>(context);
+	const symbol_list_t &symlist = *fct.m_task_symbols;
+	ContextTree &ct = *fct.m_trees[tree];
+
+	for (size_t i = 0; i < symlist.size(); i++) {
+		if (i % fct.m_trees.size() == tree) {
+			ct.update(symlist[i]);
+		} else {
+			ct.updateHistory(symlist[i]);
+		}
+	}
+}
+
+// update every tree's history, without touching the trees
+void FactoredContextTree::updateHistory(const symbol_list_t &symlist) {
+	for (size_t i = 0; i < m_trees.size(); i++) m_trees[i]->updateHistory(symlist);
+}
+
+
+// open a savepoint on every tree
+CTSavepoint FactoredContextTree::savepoint(void) {
+	if (m_trees.size() == 1) return m_trees[0]->savepoint();
+
+	m_savepoints.push_back(std::vector<CTSavepoint>(m_trees.size()));
+	for (size_t i = 0; i < m_trees.size(); i++) {
+		m_savepoints.back()[i] = m_trees[i]->savepoint();
+	}
+
+	CTSavepoint sp = { m_savepoints.size() - 1, historySize() };
+	return sp;
+}
+
+// undo every update made since the savepoint, on every tree
+void FactoredContextTree::rollback(const CTSavepoint &sp) {
+	if (m_trees.size() == 1) {
+		m_trees[0]->rollback(sp);
+		return;
+	}
+
+	assert(sp.frames < m_savepoints.size());
+	for (size_t i = 0; i < m_trees.size(); i++) {
+		m_trees[i]->rollback(m_savepoints[sp.frames][i]);
+	}
+}
+
+// close the most recently opened savepoint on every tree
+void FactoredContextTree::release(void) {
+	for (size_t i = 0; i < m_trees.size(); i++) m_trees[i]->release();
+	if (m_trees.size() > 1) m_savepoints.pop_back();
+}
+
+
+// the estimated probability of observing a sequence next, the product of
+// each tree's probability of its own bits
+double FactoredContextTree::predict(const symbol_list_t &symlist) {
+	if (m_trees.size() == 1) return m_trees[0]->predict(symlist);
+
+	m_task_symbols = &symlist;
+	m_task_log_prob.assign(m_trees.size(), 0.0);
+	m_pool->run(m_trees.size(), predictTask, this);
+
+	double log_prob = 0.0;
+	for (size_t i = 0; i < m_trees.size(); i++) log_prob += m_task_log_prob[i];
+	return exp(log_prob);
+}
+
+// one tree's log probability of its bits of the task symbols
+void FactoredContextTree::predictTask(void *context, size_t tree) {
+	FactoredContextTree &fct = *static_cast<FactoredContextTree *>(context);
+	const symbol_list_t &symlist = *fct.m_task_symbols;
+	ContextTree &ct = *fct.m_trees[tree];
+
+	CTSavepoint sp = ct.savepoint();
+	double log_prob = 0.0;
+	for (size_t i = 0; i < symlist.size(); i++) {
+		if (i % fct.m_trees.size() == tree) {
+			log_prob += log(ct.predict(symlist[i]));
+			ct.update(symlist[i]);
+		} else {
+			ct.updateHistory(symlist[i]);
+		}
+	}
+	ct.rollback(sp);
+	ct.release();
+
+	fct.m_task_log_prob[tree] = log_prob;
+}
+
+
+// the probability of every sequence of the given number of bits. Each tree
+// works out its share of the log probability for every prefix up to its
+// last bit, after which nothing can change it, and the shares are summed.
+void FactoredContextTree::predictDistribution(size_t bits, std::vector<double> &dist) {
+	if (m_trees.size() == 1) {
+		m_trees[0]->predictDistribution(bits, dist);
+		return;
+	}
+
+	assert(bits <= MaxDistributionBits);
+	m_task_bits = bits;
+	m_task_dist.resize(m_trees.size());
+	m_pool->run(m_trees.size(), distributionTask, this);
+
+	dist.assign(size_t(1) << bits, 0.0);
+	for (size_t i = 0; i < dist.size(); i++) {
+		double log_prob = 0.0;
+		for (size_t t = 0; t < m_trees.size(); t++) {
+			const std::vector<double> &share = m_task_dist[t];
+			log_prob += share[i & (share.size() - 1)];
+		}
+		dist[i] = exp(log_prob);
+	}
+}
+
+// one tree's share of the distribution, see predictDistribution
+void FactoredContextTree::distributionTask(void *context, size_t tree) {
+	FactoredContextTree &fct = *static_cast<FactoredContextTree *>(context);
+	std::vector<double> &out = fct.m_task_dist[tree];
+
+	// bits past the tree's last one have no say in its share
+	size_t bits = 0;
+	for (size_t i = tree; i < fct.m_task_bits; i += fct.m_trees.size()) bits = i + 1;
+
+	out.assign(size_t(1) << bits, 0.0);
+	ContextTree &ct = *fct.m_trees[tree];
+	CTSavepoint sp = ct.savepoint();
+	fct.distributionNode(tree, 0, bits, 0, 0.0, out);
+	ct.rollback(sp);
+	ct.release();
+}
+
+// one level of the trie traversal behind distributionTask
+void FactoredContextTree::distributionNode(size_t tree, size_t bit, size_t bits,
+	size_t prefix, double log_prob, std::vector<double> &out) {
+
+	if (bit == bits) {
+		out[prefix] = log_prob;
+		return;
+	}
+
+	ContextTree &ct = *m_trees[tree];
+	bool own = bit % m_trees.size() == tree;
+	double log_prob_one = own ? log(ct.predict(true)) : 0.0;
+
+	for (int sym = 0; sym < 2; sym++) {
+		size_t next = prefix | (size_t(sym) << bit);
+		if (own) {
+			double log_prob_sym = sym ? log_prob_one : log(ct.predict(false));
+			ct.update(sym != 0);
+			distributionNode(tree, bit + 1, bits, next, log_prob + log_prob_sym, out);
+			ct.revert();
+		} else {
+			size_t history = ct.historySize();
+			ct.updateHistory(sym != 0);
+			distributionNode(tree, bit + 1, bits, next, log_prob, out);
+			ct.revertHistory(history);
+		}
+	}
+}
+
+
+// generate a specified number of random symbols without updating the trees
+void FactoredContextTree::genRandomSymbols(symbol_list_t &symbols, size_t bits) {
+	if (m_trees.size() == 1) {
+		m_trees[0]->genRandomSymbols(symbols, bits);
+		return;
+	}
+
+	CTSavepoint sp = savepoint();
+	genRandomSymbolsAndUpdate(symbols, bits);
+	rollback(sp);
+	release();
+}
+
+// generate a specified number of random symbols and update the trees with
+// them. Each bit depends on the ones before it, so this runs serially.
+void FactoredContextTree::genRandomSymbolsAndUpdate(symbol_list_t &symbols, size_t bits) {
+	if (m_trees.size() == 1) {
+		m_trees[0]->genRandomSymbolsAndUpdate(symbols, bits);
+		return;
+	}
+
+	for (size_t i = 0; i < bits; i++) {
+		symbol_t sym = factor(i).predictNext();
+		symbols.push_back(sym);
+		updateBit(i, sym);
+	}
+}
+
+// update the tree a position belongs to with the symbol there, the others
+// only take it into their history
+void FactoredContextTree::updateBit(size_t bit, symbol_t sym) {
+	ContextTree &owner = factor(bit);
+	for (size_t t = 0; t < m_trees.size(); t++) {
+		if (m_trees[t] == &owner) {
+			m_trees[t]->update(sym);
+		} else {
+			m_trees[t]->updateHistory(sym);
+		}
+	}
+}
+
+
+// the logarithm of the block probability of the whole sequence
+double FactoredContextTree::logBlockProbability(void) {
+	double log_prob = 0.0;
+	for (size_t i = 0; i < m_trees.size(); i++) {
+		log_prob += m_trees[i]->logBlockProbability();
+	}
+	return log_prob;
+}
+
+// number of nodes over all the trees
+size_t FactoredContextTree::size(void) const {
+	size_t nodes = 0;
+	for (size_t i = 0; i < m_trees.size(); i++) nodes += m_trees[i]->size();
+	return nodes;
+}
+
+// the size and activity of all the trees together
+void FactoredContextTree::stats(CTStats &stats) const {
+	stats = CTStats();
+	for (size_t i = 0; i < m_trees.size(); i++) {
+		CTStats tree;
+		m_trees[i]->stats(tree);
+		stats.add(tree);
+	}
+}
+
+// share a node budget evenly between the trees
+void FactoredContextTree::setMaxNodes(size_t nodes) {
+	size_t share = nodes / m_trees.size();
+	if (nodes > 0 && share == 0) share = 1;
+	for (size_t i = 0; i < m_trees.size(); i++) m_trees[i]->setMaxNodes(share);
+}
+
+// weigh updates straight away, or only once something reads the weights
+void FactoredContextTree::setLazyWeights(bool lazy) {
+	for (size_t i = 0; i < m_trees.size(); i++) m_trees[i]->setLazyWeights(lazy);
+}
+
+// recompute the weights every tree has deferred
+void FactoredContextTree::refreshWeights(void) {
+	for (size_t i = 0; i < m_trees.size(); i++) m_trees[i]->refreshWeights();
+}
+
+// how many history symbols beyond the context every tree keeps resident
+void FactoredContextTree::setHistoryWindow(size_t symbols) {
+	for (size_t i = 0; i < m_trees.size(); i++) m_trees[i]->setHistoryWindow(symbols);
+}
+
+// write every tree to a checkpoint
+void FactoredContextTree::save(CheckpointWriter &out) {
+	assert(m_savepoints.empty());
+	for (size_t i = 0; i < m_trees.size(); i++) m_trees[i]->save(out);
+}
+
+// read every tree back from a checkpoint
+bool FactoredContextTree::load(CheckpointReader &in) {
+	assert(m_savepoints.empty());
+	for (size_t i = 0; i < m_trees.size(); i++) {
+		if (!m_trees[i]->load(in)) {
+			clear();
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// print the context trees
+std::string FactoredContextTree::prettyPrint(void) {
+	if (m_trees.size() == 1) return m_trees[0]->prettyPrint();
+
+	std::ostringstream answer;
+	for (size_t i = 0; i < m_trees.size(); i++) {
+		answer << "Bit " << i << ":" << std::endl << m_trees[i]->prettyPrint();
+	}
+	return answer.str();
+}
+
+// print the agent's history
+std::string FactoredContextTree::printHistory(void) {
+	return m_trees[0]->printHistory();
 }
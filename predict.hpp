@@ -1,26 +1,112 @@
 #ifndef __PREDICT_HPP__
 #define __PREDICT_HPP__
 
-#include <deque>
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <new>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "checkpoint.hpp"
+#include "logmath.hpp"
 #include "main.hpp"
 
 // stores symbol occurrence counts
 typedef unsigned int count_t;
 
-// holds context weights
-typedef double weight_t;
+// context weights, weight_t, are defined by logmath.hpp
 
-// stores the agent's history in terms of primitive symbols
-typedef std::deque<symbol_t> history_t;
+// Stores the agent's history in terms of primitive symbols, packed 64 to a
+// word in a ring buffer. Every symbol ever added is counted, but only the
+// most recent ones stay resident: at least window() of them below the
+// current length, and below the length at each pinned position, so that
+// rolling back to a savepoint always finds the context it needs. The
+// buffer only grows when a pinned symbol would otherwise be overwritten.
+class CTHistory {
+public:
+	// a history keeping at least window symbols resident
+	CTHistory(size_t window);
+
+	// forget every symbol, pins stay in place
+	void clear(void);
+
+	// the number of symbols in the history, resident or not
+	size_t size(void) const { return m_size; }
+
+	// the number of symbols still resident, the most recent ones
+	size_t resident(void) const { return m_size - m_first; }
+
+	// the guaranteed number of resident symbols, which may be raised
+	size_t window(void) const { return m_window; }
+	void setWindow(size_t window);
+
+	// add a symbol, or take the most recent one away again
+	void push_back(symbol_t sym);
+	void pop_back(void) { assert(m_size > m_first); m_size--; }
+
+	// the symbol at a position in the history, which must be resident
+	symbol_t operator[](size_t i) const {
+		assert(m_first <= i && i < m_size);
+		return (m_words[(i >> 6) & m_word_mask] >> (i & 63)) & 1;
+	}
+
+	// the n'th most recent symbol, 0 being the last one
+	symbol_t recent(size_t n) const { return (*this)[m_size - 1 - n]; }
+	symbol_t back(void) const { return recent(0); }
+
+	// n <= 64 resident symbols from position i on, symbol i + j in bit j
+	unsigned long long word(size_t i, size_t n) const;
+
+	// keep the history from the current length down resident until the
+	// matching unpin(). Pins nest.
+	void pin(void) { m_pins.push_back(m_size); }
+	void unpin(void) { assert(!m_pins.empty()); m_pins.pop_back(); }
+
+	// bytes reserved for the ring buffer
+	size_t bytes(void) const { return m_words.capacity() * sizeof(m_words[0]); }
+
+	// write the resident symbols to a checkpoint, and read them back
+	void save(CheckpointWriter &out) const;
+	bool load(CheckpointReader &in);
+
+private:
+	// double the ring buffer
+	void grow(void);
+
+	std::vector<unsigned long long> m_words;
+	size_t m_word_mask;	// the ring buffer holds m_word_mask + 1 words
+	size_t m_size;		// symbols in the history
+	size_t m_first;		// the oldest resident symbol
+	size_t m_window;
+	std::vector<size_t> m_pins;
+};
+
+// index of a node within a context tree's node arena. Nothing links to the
+// root, which lives at index 0 in all but shared views, so 0 doubles as the
+// "no child" marker.
+typedef unsigned int node_index_t;
+
+// a hash of a context, which keys the nodes of a hashed context tree
+typedef unsigned long long context_hash_t;
+
+// how a context tree is made from another one
+enum TreeCopy {
+	DeepCopy,  // copy every node
+	SharedView // share the other tree's nodes, copying them on write, see ContextTree
+};
 
 class CTNode {
 	friend class ContextTree; // i.e. ContextTree can access private members of CTNode
+	template <class T> friend class CTArena;
 
 public:
 	// log weighted blocked probability
-	weight_t logProbWeighted(void) const { return m_log_prob_weighted; }
+	weight_t logProbWeighted(void) const {
+		if (!dirty()) return m_log_prob_weighted;
+		return WeightHalf + weightAdd(m_log_prob_est, -m_log_prob_weighted);
+	}
 
 	// log KT estimated probability
 	weight_t logProbEstimated(void) const { return m_log_prob_est; }
@@ -28,50 +114,378 @@ public:
 	// the number of times this context has been visited
 	count_t visits(void) const { return m_count[false] + m_count[true]; }
 
-	// child corresponding to a particular symbol
-	const CTNode *child(symbol_t sym) const { return m_child[sym]; }
-
-	// best cheating function ever
-	void update(symbol_t sym, int depth, history_t history);
-  
-	// number of descendants
-	size_t size(void) const;
-	
+	// arena index of the child corresponding to a particular symbol,
+	// 0 if that context has never been visited. Hashed trees have no links.
+	node_index_t child(symbol_t sym) const { return m_child[sym]; }
 
 private:
 	CTNode(void);
 
-	CTNode(const CTNode &other);
-
-	~CTNode(void);
-
-	// clone a CTNode
-	//void cloneNode(CTNode &src, CTNode &dst);
-
 	// compute the logarithm of the KT-estimator update multiplier
-	double logKTMul(symbol_t sym) const;
+	weight_t logKTMul(symbol_t sym) const { return weightKT(m_count[sym], m_count[!sym]); }
+
+	// recompute the weighted probability of an internal node from its
+	// estimator and the summed log weighted probabilities of its children
+	void updateWeighted(weight_t log_prob_children);
 
-	// remove a single symbol from the context tree
-	void revert(symbol_t sym, int depth, history_t history);
+	// whether the node holds the negated summed log weighted probability
+	// of its children instead of its own, see ContextTree::setLazyWeights.
+	// Log probabilities are never positive, so one can't be mistaken for
+	// the other.
+	bool dirty(void) const { return m_log_prob_weighted > 0; }
 
 	weight_t m_log_prob_est;	  // log KT estimated probability
 	weight_t m_log_prob_weighted; // log weighted block probability
 
 	// one slot for each symbol
 	count_t m_count[2];  // a,b in CTW literature
-	CTNode *m_child[2];
-	
-	std::string prettyPrintNode(int depth);
+	union {
+		node_index_t m_child[2];	// the children of a standard node
+		context_hash_t m_key;		// what a hashed node is found by, see CTHashTable
+	};
+};
+
+
+// stores the nodes of a context tree in large contiguous blocks. Nodes are
+// never freed individually, the whole arena is released at once.
+template <class T>
+class CTArena {
+public:
+	CTArena(void) : m_size(0), m_map(NULL), m_borrowed_blocks(0) { return; }
+
+	// copy another arena, or share its blocks. A shared arena reads the
+	// other's nodes in place, and allocates from a block of its own past
+	// them, so its indices start over at a block boundary.
+	CTArena(const CTArena &other, TreeCopy copy = DeepCopy);
+
+	~CTArena(void);
+
+	// allocate a fresh node, returning its index
+	node_index_t alloc(void);
+
+	// release every node at once, the blocks are kept for reuse unless they
+	// were shared
+	void clear(void) {
+		if (m_borrowed_blocks > 0 && !m_map) release();
+		m_size = 0;
+	}
+
+	// release every node allocated after the arena held n nodes
+	void truncate(size_t n) { assert(n <= m_size); m_size = n; }
+
+	// number of nodes currently allocated
+	size_t size(void) const { return m_size; }
+
+	// bytes of node storage reserved by the arena, not counting shared blocks
+	size_t capacity(void) const {
+		size_t owned = m_map ? m_blocks.size() : m_blocks.size() - m_borrowed_blocks;
+		return owned * BlockSize * sizeof(T);
+	}
+
+	T &operator[](node_index_t i) { return m_blocks[i >> BlockBits][i & BlockMask]; }
+	const T &operator[](node_index_t i) const { return m_blocks[i >> BlockBits][i & BlockMask]; }
+
+	// write the nodes to a checkpoint as one aligned array
+	void save(CheckpointWriter &out) const;
+
+	// replace the nodes with n read back from a checkpoint. Whole blocks are
+	// mapped from the file rather than read, only the last, partial, block
+	// is copied into memory.
+	bool load(CheckpointReader &in, size_t n);
+
+private:
+	CTArena &operator=(const CTArena &other); // not implemented
+
+	// free every block
+	void release(void);
+
+	// raw storage for a block, alloc() sets up each node as it hands it
+	// out, so that a view that copies a few nodes doesn't construct and
+	// fault in a whole block
+	static T *newBlock(void) { return static_cast<T *>(::operator new(BlockSize * sizeof(T))); }
+	static void deleteBlock(T *block) { ::operator delete(block); }
+
+	static const unsigned int BlockBits = 16;
+	static const size_t BlockSize = size_t(1) << BlockBits;
+	static const node_index_t BlockMask = BlockSize - 1;
+
+	std::vector<T *> m_blocks;
+	size_t m_size;
+
+	// the first m_borrowed_blocks blocks are not ours to free: they live in
+	// a checkpoint mapping, m_map, or belong to the arena this one shares
+	void *m_map;
+	size_t m_borrowed_blocks;
+};
+
+// defined here as well, as std::min binds its arguments to references
+template <class T>
+const size_t CTArena<T>::BlockSize;
+
+template <class T>
+CTArena<T>::CTArena(const CTArena &other, TreeCopy copy) :
+	m_size(other.m_size),
+	m_map(NULL),
+	m_borrowed_blocks(0)
+{
+	if (copy == SharedView) {
+		m_borrowed_blocks = (m_size + BlockSize - 1) / BlockSize;
+		m_blocks.assign(other.m_blocks.begin(), other.m_blocks.begin() + m_borrowed_blocks);
+		m_size = m_borrowed_blocks * BlockSize;
+		return;
+	}
+
+	// only copy the blocks that are actually in use
+	size_t remaining = m_size;
+	for (size_t b = 0; remaining > 0; b++) {
+		size_t n = remaining < BlockSize ? remaining : BlockSize;
+		T *block = newBlock();
+		std::copy(other.m_blocks[b], other.m_blocks[b] + n, block);
+		m_blocks.push_back(block);
+		remaining -= n;
+	}
+}
+
+template <class T>
+CTArena<T>::~CTArena(void) {
+	release();
+}
+
+// free every block
+template <class T>
+void CTArena<T>::release(void) {
+	for (size_t b = m_borrowed_blocks; b < m_blocks.size(); b++) {
+		deleteBlock(m_blocks[b]);
+	}
+	if (m_map) CheckpointReader::unmap(m_map, m_borrowed_blocks * BlockSize * sizeof(T));
+	m_blocks.clear();
+	m_size = 0;
+	m_map = NULL;
+	m_borrowed_blocks = 0;
+}
+
+// write the nodes to a checkpoint as one aligned array
+template <class T>
+void CTArena<T>::save(CheckpointWriter &out) const {
+	out.align();
+	for (size_t b = 0; b * BlockSize < m_size; b++) {
+		size_t n = std::min(m_size - b * BlockSize, BlockSize);
+		out.write(m_blocks[b], n * sizeof(T));
+	}
+}
+
+// replace the nodes with n read back from a checkpoint
+template <class T>
+bool CTArena<T>::load(CheckpointReader &in, size_t n) {
+	release();
+	in.align();
+
+	size_t full = n / BlockSize;
+	if (full > 0) {
+		m_map = in.map(full * BlockSize * sizeof(T));
+		if (!m_map) return false;
+		m_borrowed_blocks = full;
+		for (size_t b = 0; b < full; b++) {
+			m_blocks.push_back(static_cast<T *>(m_map) + b * BlockSize);
+		}
+	}
+	if (n % BlockSize > 0) {
+		m_blocks.push_back(newBlock());
+		if (!in.read(m_blocks.back(), (n % BlockSize) * sizeof(T))) return false;
+	}
+	m_size = n;
+	return true;
+}
+
+// allocate a fresh node, returning its index
+template <class T>
+node_index_t CTArena<T>::alloc(void) {
+	assert(m_size < size_t(std::numeric_limits<node_index_t>::max()));
+
+	if (m_size == m_blocks.size() * BlockSize) {
+		m_blocks.push_back(newBlock());
+	}
+	node_index_t idx = node_index_t(m_size++);
+	// blocks start out uninitialised and are reused after clear()
+	(*this)[idx] = T();
+	return idx;
+}
+
+
+// stores symbol occurrence counts in the compact node format
+typedef unsigned short compact_count_t;
+
+// statistics of an internal node in the compact format. Instead of the
+// two absolute log probabilities, which grow without bound and would lose
+// all precision as floats, it keeps log(beta) with beta = Pe / (Pw0 * Pw1),
+// which is all the weighting actually depends on.
+struct CTCompactNode {
+	compact_count_t count[2];
+	float log_beta;
+};
+
+// statistics of a leaf in the compact format. A leaf's weighted probability
+// is its estimated probability, so the counts are all there is to store.
+struct CTCompactLeaf {
+	compact_count_t count[2];
+};
+
+// child links of an internal node in the compact format
+struct CTCompactLinks {
+	node_index_t child[2];
+};
+
+// compact context tree storage, laid out as separate arrays for the
+// internal node statistics, the internal node links and the leaves. A
+// leaf index and an internal index live in different arrays, which node a
+// child link refers to is implied by its depth. Leaf 0 is reserved so that
+// 0 can still mean "no child".
+class CTCompactArena {
+public:
+	CTCompactArena(void) { clear(); }
+
+	// copy another compact arena, or share its arrays, as for CTArena
+	CTCompactArena(const CTCompactArena &other, TreeCopy copy = DeepCopy) :
+		m_nodes(other.m_nodes, copy),
+		m_links(other.m_links, copy),
+		m_leaves(other.m_leaves, copy)
+	{ return; }
+
+	// release every node at once
+	void clear(void);
+
+	// allocate a fresh internal node or leaf, returning its index
+	node_index_t allocNode(void) { m_links.alloc(); return m_nodes.alloc(); }
+	node_index_t allocLeaf(void) { return m_leaves.alloc(); }
+
+	// number of nodes currently allocated
+	size_t size(void) const { return m_nodes.size() + m_leaves.size() - 1; }
+
+	// bytes of node storage reserved by the three arrays
+	size_t capacity(void) const {
+		return m_nodes.capacity() + m_links.capacity() + m_leaves.capacity();
+	}
+
+	// fill levels of the internal node and leaf arrays, and a way back to them
+	size_t nodes(void) const { return m_nodes.size(); }
+	size_t leaves(void) const { return m_leaves.size(); }
+	void truncate(size_t nodes, size_t leaves) {
+		m_nodes.truncate(nodes);
+		m_links.truncate(nodes);
+		m_leaves.truncate(leaves);
+	}
+
+	CTCompactNode &node(node_index_t i) { return m_nodes[i]; }
+	const CTCompactNode &node(node_index_t i) const { return m_nodes[i]; }
+	CTCompactLinks &links(node_index_t i) { return m_links[i]; }
+	const CTCompactLinks &links(node_index_t i) const { return m_links[i]; }
+	CTCompactLeaf &leaf(node_index_t i) { return m_leaves[i]; }
+	const CTCompactLeaf &leaf(node_index_t i) const { return m_leaves[i]; }
+
+	// write the three arrays to a checkpoint, and read them back
+	void save(CheckpointWriter &out) const;
+	bool load(CheckpointReader &in, size_t nodes, size_t leaves);
+
+private:
+	CTArena<CTCompactNode> m_nodes;
+	CTArena<CTCompactLinks> m_links;
+	CTArena<CTCompactLeaf> m_leaves;
+};
+
+
+// an open addressing table of the nodes of a hashed context tree: a run of
+// slots in the tree's node arena, a power of two long, probed linearly from
+// the slot a node's key picks. Instead of child links every node carries
+// the key of its context, so all the nodes of a context path can be looked
+// up at once.
+struct CTHashTable {
+	node_index_t base;	// arena index of the first slot
+	size_t slots;
+	unsigned int shift;	// 64 - log2(slots), to pick a slot from a key
+	size_t live;		// nodes in the table
+	size_t erased;		// slots left behind by erased nodes
+};
+
+
+// a node as it was before a journaled update touched it
+struct CTJournalEntry {
+	node_index_t idx;
+	CTNode node;
+};
+
+// the compact equivalent, a leaf's counts are kept in node.count
+struct CTCompactJournalEntry {
+	node_index_t idx;
+	bool leaf;
+	CTCompactNode node;
+	CTCompactLinks links;
+};
+
+// everything needed to undo one journaled update besides its entries
+struct CTJournalFrame {
+	size_t entries;		// journal length before the update
+	size_t nodes;		// node arena fill level, or hashed nodes inserted, before the update
+	size_t leaves;		// compact leaf arena fill level before the update
+	size_t created;		// depth of the first node the update allocated
+	double log_block_prob;	// compact block probability before the update
+};
+
+// a position in a context tree's undo journal, see ContextTree::savepoint
+struct CTSavepoint {
+	size_t frames;	// journaled updates made before the savepoint
+	size_t history;	// history length at the savepoint
+};
+
+
+// storage layout of the context tree nodes
+enum NodeFormat {
+	StandardNodes, // CTNode: double log probabilities, 32-bit counts
+	CompactNodes,  // CTCompactArena: float log ratios, 16-bit counts
+	HashedNodes    // CTNode in a CTHashTable: found by context, no child links
 };
 
+class WorkerPool;
+
+// a snapshot of the size and activity of one or more context trees, see
+// ContextTree::stats. The activity counters run from the tree's creation.
+struct CTStats {
+	CTStats(void);
+
+	// add another tree's statistics to these
+	void add(const CTStats &other);
+
+	// mean number of nodes on the context path of an update that were
+	// already allocated, that is how deep the context had been seen before
+	double meanPathLength(void) const;
+
+	size_t nodes;				// nodes in the tree
+	std::vector<size_t> depth_nodes;	// nodes at each depth, the root's first
+	size_t bytes;				// memory reserved for the tree
+	unsigned long long updates;		// updates of the tree itself, past the pre-history
+	unsigned long long reverts;
+	unsigned long long predictions;
+	unsigned long long path_nodes;		// context path nodes those updates found allocated
+};
+
+// longest sequence ContextTree::predictDistribution will enumerate
+static const size_t MaxDistributionBits = 16;
+
 class ContextTree {
 public:
 
 	// create a context tree of specified maximum depth
-	ContextTree(size_t depth);
+	ContextTree(size_t depth, NodeFormat format = StandardNodes);
 	
-	// create a context tree from another context tree
-	ContextTree(const ContextTree &ct);
+	// create a context tree from another context tree. A SharedView copies
+	// nothing but the history: it reads the other tree's nodes in place and
+	// writes its updates into copies of the nodes on their paths, held in
+	// arena blocks of its own, so any number of views, each used by one
+	// thread, can run their own simulations against one model. The other
+	// tree must not change while views of it exist, and it can have no open
+	// savepoint or lazy weights still to refresh. A view has no node
+	// budget, and can't be pruned or saved, but clearing it, or loading into
+	// it, detaches it from the other tree.
+	ContextTree(const ContextTree &ct, TreeCopy copy = DeepCopy);
 
 	~ContextTree(void);
 
@@ -82,19 +496,38 @@ public:
   // std::string prettyPrint(void);				 
   
 	// updates the context tree with a new binary symbol
-	void update(symbol_t sym); // TODO: implement in predict.cpp
-	void update(const symbol_list_t &symlist); // TODO: implement in predict.cpp
+	void update(symbol_t sym);
+	void update(const symbol_list_t &symlist);
+	void updateHistory(symbol_t sym);
 	void updateHistory(const symbol_list_t &symlist);
 
 	// removes the most recently observed symbol from the context tree
-	void revert(void); // TODO: implement in predict.cpp
+	void revert(void);
 
 	// shrinks the history down to a former size
 	void revertHistory(size_t newsize);
 
+	// open a savepoint. Until it is released every update is journaled, so
+	// that revert() and rollback() restore the nodes it touched exactly,
+	// rather than running the KT arithmetic backwards. Savepoints nest.
+	CTSavepoint savepoint(void);
+
+	// undo every update and history change made since the savepoint. The
+	// savepoint stays open and can be rolled back to again.
+	void rollback(const CTSavepoint &sp);
+
+	// close the most recently opened savepoint, keeping the changes made
+	// since. Closing the outermost one discards the journal.
+	void release(void);
+
 	// the estimated probability of observing a particular symbol or sequence
-	double predict(symbol_t sym); // TODO: implement in predict.cpp
-	double predict(symbol_list_t symlist); // TODO: implement in predict.cpp
+	double predict(symbol_t sym);
+	double predict(const symbol_list_t &symlist);
+
+	// the probability of every sequence of the given number of bits, indexed
+	// so that bit i of the index is the i'th symbol of the sequence. Only
+	// meant for short sequences, at most MaxDistributionBits long.
+	void predictDistribution(size_t bits, std::vector<double> &dist);
 
 	// generate a specified number of random symbols
 	// distributed according to the context tree statistics
@@ -103,12 +536,13 @@ public:
 	// generate a specified number of random symbols distributed according to
 	// the context tree statistics and update the context tree with the newly
 	// generated bits
-	void genRandomSymbolsAndUpdate(symbol_list_t &symbols, size_t bits); // TODO: implement in predict.cpp
+	void genRandomSymbolsAndUpdate(symbol_list_t &symbols, size_t bits);
 
 	// the logarithm of the block probability of the whole sequence
 	double logBlockProbability(void);
 
-	// get the n'th history symbol, NULL if doesn't exist
+	// get the n'th history symbol, NULL if doesn't exist or is no longer
+	// resident
 	const symbol_t *nthHistorySymbol(size_t n) const;
 
 	// the depth of the context tree
@@ -117,28 +551,352 @@ public:
 	// the size of the stored history
 	size_t historySize(void) const { return m_history.size(); }
 
+	// how many history symbols beyond the context are kept resident, which
+	// bounds how far revert() and revertHistory() can go back outside of a
+	// savepoint
+	void setHistoryWindow(size_t symbols);
+
 	// number of nodes in the context tree
-	size_t size(void) const { return m_root ? m_root->size() : 0; }
+	size_t size(void) const;
 
-	// guess the most likely very next symbol
+	// whether the tree is a shared view of another one
+	bool isView(void) const { return m_shared_leaves > 0; }
+
+	// the size and activity of the tree, all kept up to date as it goes
+	// except for bytes, which is added up on the spot
+	void stats(CTStats &stats) const;
+
+	// the storage layout of the nodes
+	NodeFormat format(void) const { return m_format; }
+
+	// the node budget, 0 if the tree may grow without limit. Updates that
+	// take the tree over it prune it back to three quarters of it.
+	size_t maxNodes(void) const { return m_max_nodes; }
+	void setMaxNodes(size_t nodes);
+
+	// evict the least visited, or most estimator-dominated, subtrees until
+	// at most the given number of nodes remain. Not allowed while a
+	// savepoint is open.
+	void prune(size_t nodes);
+
+	// write the tree and its history to a checkpoint, and read them back
+	// into a tree of the same depth and node format. No savepoint may be
+	// open. A failed load leaves the tree cleared.
+	void save(CheckpointWriter &out);
+	bool load(CheckpointReader &in);
+
+	// in lazy mode updates and reverts leave the nodes on their path dirty,
+	// holding the summed weighted probability of their children instead of
+	// their own, which is worked out from it whenever it is read. The next
+	// update through a dirty node then adjusts that sum by the change in
+	// the child on the path, and predictions take the other child's weight
+	// from it likewise, so neither looks the siblings off the path up, as
+	// the compact format never has to. Only standard and hashed nodes have
+	// anything to defer.
+	bool lazyWeights(void) const { return m_lazy_weights; }
+	void setLazyWeights(bool lazy);
+
+	// store every weight lazy mode has left dirty plainly again, as a tree
+	// must have before it is shared by views
+	void refreshWeights(void);
+
+	// guess the most likely very next symbol, a 1 with the probability
+	// nextProbability() gives
 	symbol_t predictNext();
+	double nextProbability(void);
 	
 	// print the context tree
 	std::string prettyPrint();
 	
-	// print one node of the context tree
-	std::string prettyPrintNode(int depth);
-	
 	// print the agent's history
 	std::string printHistory(void);
 	
 
 private:
-	history_t m_history; // the agents history
-	CTNode *m_root;	  // the root node of the context tree
+	// resolve the context path for the next symbol from the most recent
+	// m_depth history bits, optionally filling out the tree as we go.
+	// Returns the number of nodes on the path that exist.
+	size_t walkPath(bool create) { return (this->*m_walk_path)(create); }
+
+	// walkPath() specialised for a tree depth and node format, so that the
+	// loops over the context have constant bounds and the context itself
+	// sits in a stack buffer. Depth 0 is the generic version, which reads
+	// m_depth instead. selectEngine() picks the one for this tree.
+	template <size_t Depth, NodeFormat Format> size_t walkPathFixed(bool create);
+	template <size_t Depth> size_t walkPathHashed(bool create);
+	void selectEngine(void);
+
+	// hashed trees: bring the suffix hashes of the context up to date with
+	// the history, the key of a node's child, and finding, inserting and
+	// making room for nodes in the tables
+	void hashHistory(void);
+	context_hash_t childKey(size_t depth, node_index_t idx, symbol_t sym) const;
+	node_index_t findHashed(context_hash_t key, node_index_t parent) const;
+	node_index_t probeHashed(const CTHashTable &table, context_hash_t key) const;
+	void prefetchHashed(context_hash_t key) const;
+	node_index_t insertHashed(CTHashTable &table, context_hash_t key);
+	void eraseHashed(node_index_t idx);
+	void reserveHashed(bool scratch, size_t nodes);
+	void setTable(CTHashTable &table, node_index_t base, size_t slots);
+	void newTable(CTHashTable &table, size_t slots);
+	void rehash(size_t slots, size_t scratch_slots, bool pruned);
+	void mergeScratch(void);
+
+	// log weighted probability of a (possibly missing) child
+	weight_t childWeighted(size_t depth, node_index_t idx, symbol_t sym) const;
+
+	// log weighted probability of the child off the context path of the
+	// node at a depth on it, given that of the child on it
+	weight_t siblingWeighted(size_t depth, weight_t path_child) const;
+
+	// reweigh the node at a depth on the context path, given the weighted
+	// probability of the child on the path before and after the change,
+	// leaving it dirty in lazy mode, and return its own
+	weight_t reweighNode(size_t depth, weight_t old_child, weight_t new_child);
+
+	// format specific halves of update() and revert()
+	void updateCompact(symbol_t sym);
+	void revertCompact(symbol_t sym);
+
+	// the KT multipliers of the first n nodes on the context path
+	void pathLogKT(symbol_t sym, count_t undo, size_t n);
+
+	// counts of the last node on a complete compact context path
+	compact_count_t *compactLeafCounts(void);
+
+	// node access shared by every format, for pruning, except for childLink,
+	// as hashed trees have no links to write
+	bool isLeaf(size_t depth, node_index_t idx) const;
+	node_index_t childNode(size_t depth, node_index_t idx, symbol_t sym) const;
+	node_index_t &childLink(node_index_t idx, symbol_t sym);
+	count_t pruneScore(size_t depth, node_index_t idx) const;
+
+	// whether a node at a given depth belongs to the tree a view shares,
+	// and give the view its own copy of it, or of every node on the context
+	// path
+	bool isShared(size_t depth, node_index_t idx) const;
+	node_index_t unshareNode(size_t depth, node_index_t idx);
+	void unsharePath(void);
+
+	// recount m_depth_nodes from scratch
+	void countNodes(void);
+	void countNodes(size_t depth, node_index_t idx);
+
+	// the passes of prune()
+	void pruneLimits(size_t depth, node_index_t idx, count_t limit,
+		std::vector<count_t> &limits) const;
+	bool pruneNode(size_t depth, node_index_t idx, count_t threshold, double &log_delta);
+	void pruneRelink(size_t depth, node_index_t idx);
+
+	// one level of the joint trie traversal behind predictDistribution
+	void distributionNode(size_t bit, size_t bits, size_t prefix,
+		double log_prob, std::vector<double> &dist);
+
+	// journal a node on the context path before an update changes it
+	void journalNode(size_t depth, node_index_t idx);
+
+	// undo the most recent journaled update, leaving the history alone
+	void restoreFrame(void);
+
+	// print one node of the context tree and its descendants
+	std::string prettyPrintNode(node_index_t idx, int depth) const;
+	std::string prettyPrintCompact(node_index_t idx, int depth) const;
+
+	static const node_index_t Root = 0; // arena index of the root node, but see m_root
+
+	// child link marking an internal node that has been pruned into a leaf
+	static const node_index_t PrunedLeaf = ~node_index_t(0);
+
+	CTHistory m_history; // the agents history
 	size_t m_depth;	  // the maximum depth of the context tree
-	
+	NodeFormat m_format; // which of the node stores is in use
+
+	CTArena<CTNode> m_nodes;	// storage for StandardNodes and HashedNodes trees
+	CTCompactArena m_compact;	// storage for CompactNodes trees
+
+	// the root, which a view keeps its own copy of, and in a view the
+	// number of leading node and compact leaf indices that are shared.
+	// Every compact arena has its reserved leaf, so only views have shared
+	// leaves.
+	node_index_t m_root;
+	size_t m_shared_nodes;
+	size_t m_shared_leaves;
+
+	// compact trees do not store absolute probabilities, so the log block
+	// probability of the whole sequence is accumulated separately
+	double m_log_block_prob;
+
+	// hashed trees: the table of the tree's own nodes, the one journaled
+	// updates insert into, emptied as the outermost savepoint is released,
+	// those of the trees a view shares, newest first, the suffix hashes of
+	// the context at each depth as of a history length, and the nodes
+	// journaled updates inserted, for undo
+	CTHashTable m_table;
+	CTHashTable m_scratch;
+	std::vector<CTHashTable> m_shared_tables;
+	std::vector<context_hash_t> m_suffix_hash;
+	std::vector<context_hash_t> m_hash_power;
+	size_t m_hash_history;
+	std::vector<node_index_t> m_created;
+
+	// explicit node stack for the current context path, root first, and
+	// the depth of its last node, short of m_depth if it was pruned
+	std::vector<node_index_t> m_path;
+	size_t m_leaf_depth;
+
+	// the context bits walkPath() reads, for depths without a specialisation
+	std::vector<unsigned char> m_context;
+
+	// per-depth counts and KT multipliers of the current context path
+	std::vector<count_t> m_path_count;
+	std::vector<count_t> m_path_other;
+	std::vector<weight_t> m_path_log_kt;
+
+	// undo journal, only kept while a savepoint is open
+	std::vector<CTJournalEntry> m_journal;
+	std::vector<CTCompactJournalEntry> m_compact_journal;
+	std::vector<CTJournalFrame> m_frames;
+	size_t m_savepoints; // number of open savepoints
+
+	// node budget, and prune()'s old to new index maps, kept between
+	// prunes to save reallocating them
+	size_t m_max_nodes;
+	std::vector<node_index_t> m_node_remap;
+	std::vector<node_index_t> m_leaf_remap;
+
+	// the specialisation of walkPath() in use
+	size_t (ContextTree::*m_walk_path)(bool create);
+
+	// lazy weighting, and refreshWeights()'s stack of depths and nodes
+	bool m_lazy_weights;
+	std::vector<std::pair<size_t, node_index_t> > m_refresh_stack;
+
+	// statistics: nodes at each depth, the depth of the first node the last
+	// walkPath() allocated, m_depth + 1 if none, and activity counters
+	std::vector<size_t> m_depth_nodes;
+	size_t m_created_depth;
+	unsigned long long m_updates;
+	unsigned long long m_reverts;
+	unsigned long long m_predictions;
+	unsigned long long m_path_nodes;
+};
 
+
+// A model made of several context trees, one per bit position of a percept:
+// bit i of every symbol sequence is predicted by, and trained into, tree
+// i % factors(). Every tree sees the full history, so each still conditions
+// on the bits before its own, but it only holds the statistics of its own
+// bit and stays small. The trees are independent, so updates and
+// predictions are spread over a worker pool. With one factor this is just a
+// context tree.
+class FactoredContextTree {
+public:
+
+	// create factors context trees of the given depth, and a pool of the
+	// given number of threads to update them with
+	FactoredContextTree(size_t depth, NodeFormat format, size_t factors, size_t threads);
+
+	// create a factored context tree from another factored context tree,
+	// a SharedView being a view of each of its trees, see ContextTree, that
+	// updates them on the calling thread
+	FactoredContextTree(const FactoredContextTree &fct, TreeCopy copy = DeepCopy);
+
+	~FactoredContextTree(void);
+
+	// clear every tree
+	void clear(void);
+
+	// update each tree with its own bits of a symbol sequence, and every
+	// tree's history with all of them
+	void update(const symbol_list_t &symlist);
+	void updateHistory(const symbol_list_t &symlist);
+
+	// savepoints across every tree, as for a single context tree. For more
+	// than one factor sp.frames indexes our own stack of per-tree savepoints.
+	CTSavepoint savepoint(void);
+	void rollback(const CTSavepoint &sp);
+	void release(void);
+
+	// the estimated probability of observing a sequence next
+	double predict(const symbol_list_t &symlist);
+
+	// the probability of every sequence of the given number of bits, indexed
+	// as for ContextTree::predictDistribution
+	void predictDistribution(size_t bits, std::vector<double> &dist);
+
+	// generate a specified number of random symbols, each drawn from the tree
+	// its position belongs to, optionally updating the trees with them
+	void genRandomSymbols(symbol_list_t &symbols, size_t bits);
+	void genRandomSymbolsAndUpdate(symbol_list_t &symbols, size_t bits);
+
+	// generate a sequence a bit at a time, as genRandomSymbolsAndUpdate()
+	// does: the probability that the symbol at a position is a 1, and
+	// update the trees with the symbol there
+	double nextProbability(size_t bit) { return factor(bit).nextProbability(); }
+	void updateBit(size_t bit, symbol_t sym);
+
+	// the logarithm of the block probability of the whole sequence, the
+	// sum over the trees
+	double logBlockProbability(void);
+
+	// the number of trees, and the tree predicting a bit position
+	size_t factors(void) const { return m_trees.size(); }
+	ContextTree &factor(size_t bit) { return *m_trees[bit % m_trees.size()]; }
+
+	// the size of the stored history, which every tree shares
+	size_t historySize(void) const { return m_trees[0]->historySize(); }
+
+	// number of nodes over all the trees
+	size_t size(void) const;
+
+	// the size and activity of all the trees together
+	void stats(CTStats &stats) const;
+
+	// share a node budget evenly between the trees, 0 for none
+	void setMaxNodes(size_t nodes);
+
+	// how many history symbols beyond the context every tree keeps resident
+	void setHistoryWindow(size_t symbols);
+
+	// write every tree to a checkpoint, and read them back into a model
+	// of the same shape
+	void save(CheckpointWriter &out);
+	bool load(CheckpointReader &in);
+
+	// weigh every tree lazily or not, and recompute the weights every tree
+	// has deferred, see ContextTree
+	void setLazyWeights(bool lazy);
+	void refreshWeights(void);
+
+	// print the context trees
+	std::string prettyPrint(void);
+
+	// print the agent's history
+	std::string printHistory(void);
+
+private:
+	// per tree halves of update(), predict() and predictDistribution(),
+	// run as worker pool tasks
+	static void updateTask(void *context, size_t tree);
+	static void predictTask(void *context, size_t tree);
+	static void distributionTask(void *context, size_t tree);
+
+	// one level of the trie traversal behind distributionTask, recording
+	// tree's share of the log probability of each prefix up to its last bit
+	void distributionNode(size_t tree, size_t bit, size_t bits, size_t prefix,
+		double log_prob, std::vector<double> &out);
+
+	std::vector<ContextTree *> m_trees;
+	WorkerPool *m_pool;
+
+	// per-tree savepoints opened by savepoint(), innermost last
+	std::vector<std::vector<CTSavepoint> > m_savepoints;
+
+	// arguments and results of the current pool tasks
+	const symbol_list_t *m_task_symbols;
+	size_t m_task_bits;
+	std::vector<double> m_task_log_prob;
+	std::vector<std::vector<double> > m_task_dist;
 };
 
 #endif // __PREDICT_HPP__
@@ -1,15 +1,15 @@
 #include "search.hpp"
 
 #include "agent.hpp"
+#include "pool.hpp"
 #include "util.hpp"
 
-#include <map>
-#include <cmath>
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
 
 
-typedef unsigned long long visits_t;
-
 // search options
 static const visits_t	 MinVisitsBeforeExpansion = 1;
 static const unsigned int MaxDistanceFromRoot  = 100;
@@ -17,44 +17,6 @@ static const unsigned int MaxDistanceFromRoot  = 100;
 // UCB bound constants
 static const double C = 1.0;
 
-// contains information about a single "state"
-class SearchNode {
-
-public:
-
-	SearchNode();
-	SearchNode(bool is_chance_node);
-	~SearchNode(void);
-
-	// determine the next action to play
-	action_t selectAction(Agent &agent) const;
-
-	// determine the expected reward from this node
-	reward_t expectation(void) const { return m_mean; }
-	// XXX: this is ridiculous, what is the damn point of typedef-ing this
-	// stuff if you aren't even going to stick to your own definitions?
-
-	// perform a sample run through this node and it's children,
-	// returning the accumulated reward from this sample run
-	reward_t sample(Agent &agent, unsigned int dfr);
-
-	// number of times the search node has been visited
-	visits_t visits(void) const { return m_visits; }
-
-	// return pointer to child corresponding to action/percept
-	const SearchNode *child(unsigned int aor) const;
-
-private:
-
-	bool m_chance_node; // true if this node is a chance node, false otherwise
-	double m_mean;	  // the expected reward of this node
-	visits_t m_visits;  // number of times the search node has been visited
-
-	// NOTE: action_t and percept_t are both typedef unsigned int
-	typedef std::map<unsigned int, SearchNode> m_child_t;
-	m_child_t m_child;
-};
-
 // simulate a path through a hypothetical future for the agent within it's
 // internal model of the world, returning the accumulated reward.
 static reward_t playout(Agent &agent, unsigned int playout_len) { 
@@ -70,40 +32,108 @@ static reward_t playout(Agent &agent, unsigned int playout_len) {
 	return reward;
 }
 
-// determine the best action by searching ahead using MCTS
-extern action_t search(Agent &agent) {
+// a search's wall-clock budget, see search()
+class SearchDeadline {
+public:
+	// a deadline the given number of seconds from now, none if 0
+	SearchDeadline(double seconds) :
+		m_start(seconds > 0.0 ? clockSeconds() : 0.0),
+		m_budget(seconds),
+		m_next_check(1)
+	{
+	}
+
+	bool enabled(void) const { return m_budget > 0.0; }
+
+	// whether a search that has run the given number of simulations is out
+	// of time
+	bool passed(int simulations) {
+		if (simulations < m_next_check) return false;
+
+		double now = clockSeconds();
+		double left = m_start + m_budget - now;
+		if (left <= 0.0) return true;
+
+		// read the clock again after as many simulations as take a 32nd of
+		// the budget, or what is left of it
+		double rate = simulations / std::max(now - m_start, 1e-9);
+		double next = rate * std::min(left, m_budget / 32.0);
+		m_next_check = simulations + int(std::max(1.0, std::min(next, 1e9)));
+		return false;
+	}
+
+private:
+	double m_start;
+	double m_budget;
+	int m_next_check;	// the simulation count at which to read the clock
+};
+
+// the number of simulations to make room for in a tree, with a search time
+// twice as many as the tree's last search ran
+template <class Tree>
+static int expectedSimulations(const Agent &agent, const Tree &tree) {
+	if (agent.searchTime() <= 0.0) return agent.numSimulations();
+	return std::max(agent.numSimulations(), 2 * tree.simulations());
+}
+
+// search on from where the last search's tree leads, if it was one cycle
+// ago, or create new tree (start at root)
+template <class Tree>
+static void prepareTree(Agent &agent, Tree &tree, int simulations) {
+	bool reused = !tree.empty() && tree.age() + 1 == agent.age() &&
+		tree.advance(agent.lastAction(), agent.lastObservation(), simulations);
+	if (!reused) tree.reset(agent.numActions(), simulations);
+	tree.setAge(agent.age());
+}
+
+// run simulations from the agent's current state in a tree, a number of
+// them or until a deadline
+static void simulate(Agent &agent, SearchTree &tree, int simulations, SearchDeadline deadline) {
 
 	// Savepoint
-	ModelUndo mu = ModelUndo(agent);
+	ModelUndo mu(agent);
 
-	// Create new tree (start at root)
-	SearchNode *root = new SearchNode(false);
+	prepareTree(agent, tree, deadline.enabled() ? expectedSimulations(agent, tree) : simulations);
 
 	// Simulate different possible futures
-	const int simulations = agent.numSimulations();
-	for (int i = 0; i < simulations; i++) {
-		root->sample(agent, agent.horizon());
+	int i;
+	for (i = 0; deadline.enabled() ? !deadline.passed(i) : i < simulations; i++) {
+		tree.sample(agent);
 		// Restore from savepoint
-		assert(agent.modelRevert(mu));
+		bool reverted = agent.modelRevert(mu);
+		assert(reverted);
 	}
+	tree.setSimulations(i);
+}
 
-	// Determine best action
-	action_t best_action = NULL;
+// the action with the best mean reward at the root over a number of trees
+template <class Tree>
+static action_t bestAction(Agent &agent, const Tree *trees, size_t n) {
+	action_t best_action = 0;
 	double best_score = -1.0;
 
 	for (action_t a = 0; a < agent.numActions(); a++) {
-		const SearchNode *ha = root->child(a);
-		if (NULL == ha) {
+		// the mean over every tree that tried the action
+		double score = 0.0;
+		visits_t visits = 0;
+		for (size_t t = 0; t < n; t++) {
+			const typename Tree::node_type *ha = trees[t].child(trees[t].root(), a);
+			if (NULL == ha || ha->visits() == 0) {
+				continue;
+			}
+			score = visits == 0 ? ha->expectation() :
+				(score * visits + ha->expectation() * ha->visits()) / (visits + ha->visits());
+			visits += ha->visits();
+		}
+		if (visits == 0) {
 			continue;
 		}
-		double score = ha->expectation();
 		// keep track of best score
 		if (score > best_score) {
 			best_score = score;
 			best_action = a;
 		}
 	}
-	delete root;
 	if (best_score < 0.0) {
 		// pick random action
 		return agent.genRandomAction();
@@ -112,38 +142,315 @@ extern action_t search(Agent &agent) {
 	}
 }
 
+// determine the best action by searching ahead using MCTS
+extern action_t search(Agent &agent) {
+	SearchTree tree;
+	return search(agent, tree);
+}
+
+// determine the best action by searching ahead using MCTS, in a tree kept
+// between calls
+extern action_t search(Agent &agent, SearchTree &tree) {
+	simulate(agent, tree, agent.numSimulations(), SearchDeadline(agent.searchTime()));
+	return bestAction(agent, &tree, 1);
+}
+
+// a root-parallel search, shared between the pool's tasks
+struct RootParallelSearch {
+	const Agent *agent;
+	std::vector<SearchTree> *trees;
+	std::vector<unsigned int> seeds;	// each tree's random number seed
+	int simulations;	// simulations per tree, the first extra trees run one more
+	int extra;
+	SearchDeadline deadline;
+};
+
+// one tree's share of a root-parallel search
+static void rootParallelTask(void *context, size_t tree) {
+	RootParallelSearch &job = *static_cast<RootParallelSearch *>(context);
+	seedThreadRandom(job.seeds[tree]);
+
+	Agent view(*job.agent, SharedView);
+	simulate(view, (*job.trees)[tree], job.simulations + (int(tree) < job.extra ? 1 : 0), job.deadline);
+
+	// the calling thread runs tasks too
+	releaseThreadRandom();
+}
+
+// determine the best action by searching ahead using MCTS, a tree per thread
+extern action_t search(Agent &agent, std::vector<SearchTree> &trees, WorkerPool &pool) {
+	assert(!trees.empty());
+
+	// the views read the agent's model in place
+	agent.refreshModel();
+
+	// the seeds are drawn up front, so that the result doesn't depend on
+	// which thread runs which tree
+	RootParallelSearch job = { &agent, &trees, std::vector<unsigned int>(), 0, 0,
+		SearchDeadline(agent.searchTime()) };
+	for (size_t i = 0; i < trees.size(); i++) {
+		job.seeds.push_back(randRange(RAND_MAX));
+	}
+	job.simulations = agent.numSimulations() / int(trees.size());
+	job.extra = agent.numSimulations() % int(trees.size());
+
+	pool.run(trees.size(), rootParallelTask, &job);
+	return bestAction(agent, &trees[0], trees.size());
+}
+
+// a tree-parallel search, shared between the pool's tasks
+struct TreeParallelSearch {
+	const Agent *agent;
+	SharedSearchTree *tree;
+	std::vector<unsigned int> seeds;	// each thread's random number seed
+	int simulations;
+	int claimed;	// simulations claimed by the threads so far, atomically
+	int run;	// simulations finished, atomically
+	SearchDeadline deadline;	// if enabled, instead of the number
+};
+
+// one thread's part of a tree-parallel search: simulations until none are
+// left to claim, or the time is up
+static void treeParallelTask(void *context, size_t thread) {
+	TreeParallelSearch &job = *static_cast<TreeParallelSearch *>(context);
+	seedThreadRandom(job.seeds[thread]);
+
+	Agent view(*job.agent, SharedView);
+	SharedSearchTree::Scratch scratch;
+	SearchDeadline deadline = job.deadline;
+	ModelUndo mu(view);
+	int run = 0;
+	while (deadline.enabled() ? !deadline.passed(run) :
+			__atomic_fetch_add(&job.claimed, 1, __ATOMIC_RELAXED) < job.simulations) {
+		job.tree->sample(view, scratch);
+		bool reverted = view.modelRevert(mu);
+		assert(reverted);
+		run++;
+	}
+	__atomic_fetch_add(&job.run, run, __ATOMIC_RELAXED);
+
+	// the calling thread runs tasks too
+	releaseThreadRandom();
+}
+
+// determine the best action by searching ahead using MCTS, every thread in
+// one shared tree
+extern action_t search(Agent &agent, SharedSearchTree &tree, WorkerPool &pool) {
+
+	// the views read the agent's model in place
+	agent.refreshModel();
+
+	prepareTree(agent, tree, expectedSimulations(agent, tree));
+
+	TreeParallelSearch job = { &agent, &tree, std::vector<unsigned int>(),
+		agent.numSimulations(), 0, 0, SearchDeadline(agent.searchTime()) };
+	for (size_t i = 0; i < pool.threads(); i++) {
+		job.seeds.push_back(randRange(RAND_MAX));
+	}
+
+	pool.run(pool.threads(), treeParallelTask, &job);
+	tree.setSimulations(job.run);
+	return bestAction(agent, &tree, 1);
+}
+
 SearchNode::SearchNode(bool chance) :
 	m_chance_node(chance),
+	m_percept(0),
 	m_mean(0.0),
-	m_visits(0)
+	m_visits(0),
+	m_slots(0),
+	m_capacity(0),
+	m_children(0)
 {
 }
 
-SearchNode::SearchNode() :
-	m_chance_node(false),
-	m_mean(0.0),
-	m_visits(0)
+
+SearchTree::SearchTree(void) :
+	m_actions(0),
+	m_age(0),
+	m_simulations(0)
 {
 }
 
-SearchNode::~SearchNode(void) {
-	
-	for (int i = 0; i<m_child.size(); i++){
-		m_child.erase(i);
+// drop every node, leaving a fresh root
+void SearchTree::reset(unsigned int actions, int simulations) {
+	m_actions = actions;
+	m_nodes.clear();
+	m_slots.clear();
+	m_percept_trie.assign(1, PerceptBit());
+	reserve(simulations);
+	m_nodes.push_back(SearchNode(false));
+}
+
+// make the decision node an action and observation lead to the new root
+bool SearchTree::advance(action_t action, percept_t observation, int simulations) {
+	search_index_t chance = findChild(0, action);
+	search_index_t idx = chance ? findChild(chance, observation) : 0;
+	if (!idx) return false;
+
+	// copy the subtree over depth first, numbering it from 0. A chance
+	// node's table keeps its size, so every entry stays in its slot. The
+	// model has moved on, so the percept tries are dropped.
+	m_spare_nodes.clear();
+	m_spare_slots.clear();
+	m_percept_trie.assign(1, PerceptBit());
+	m_spare_nodes.push_back(m_nodes[idx]);
+	m_copy_stack.push_back(std::make_pair(idx, search_index_t(0)));
+	while (!m_copy_stack.empty()) {
+		search_index_t from = m_copy_stack.back().first;
+		search_index_t to = m_copy_stack.back().second;
+		m_copy_stack.pop_back();
+
+		const SearchNode &node = m_nodes[from];
+		if (node.m_capacity == 0) continue;
+		m_spare_nodes[to].m_slots = m_spare_slots.size();
+		for (size_t i = node.m_slots; i < node.m_slots + node.m_capacity; i++) {
+			Slot slot = m_slots[i];
+			if (slot.node) {
+				search_index_t copy = search_index_t(m_spare_nodes.size());
+				m_spare_nodes.push_back(m_nodes[slot.node]);
+				if (m_spare_nodes.back().m_chance_node) m_spare_nodes.back().m_percept = 0;
+				m_copy_stack.push_back(std::make_pair(slot.node, copy));
+				slot.node = copy;
+			}
+			m_spare_slots.push_back(slot);
+		}
 	}
+
+	m_nodes.swap(m_spare_nodes);
+	m_slots.swap(m_spare_slots);
+	reserve(simulations);
+	return true;
+}
+
+// make room for a search of the given number of simulations
+void SearchTree::reserve(int simulations) {
+	// a simulation adds at most a chance node and a decision node, and
+	// expands at most one decision node
+	size_t nodes = 2 * size_t(simulations) + 1;
+	m_nodes.reserve(m_nodes.size() + nodes);
+	m_slots.reserve(m_slots.size() + nodes / 2 * std::max(m_actions, 2 * ChanceSlots));
+	m_unexplored.reserve(m_actions);
+	m_best.reserve(m_actions);
+}
+
+// perform a sample run from the root
+reward_t SearchTree::sample(Agent &agent) {
+	return sample(agent, 0, agent.horizon(), true);
 }
 
 // return pointer to child corresponding to action/percept
-const SearchNode* SearchNode::child(unsigned int aor) const {
-	m_child_t::const_iterator it = m_child.find(aor);
-	if (it == m_child.end()) {
-		return NULL;
+const SearchNode *SearchTree::child(const SearchNode &node, unsigned int aor) const {
+	search_index_t idx = findChild(search_index_t(&node - &m_nodes[0]), aor);
+	return idx ? &m_nodes[idx] : NULL;
+}
+
+// the child of a node for an action or observation, 0 if there is none
+search_index_t SearchTree::findChild(search_index_t idx, unsigned int aor) const {
+	const SearchNode &node = m_nodes[idx];
+	if (node.m_capacity == 0) return 0;
+	if (!node.m_chance_node) return m_slots[node.m_slots + aor].node;
+	return m_slots[chanceSlot(node, aor)].node;
+}
+
+// the slot of a chance node's table that holds an observation, or the
+// empty one it would go in. The table size is a power of two, at least
+// ChanceSlots, and the slot comes from the top bits of the hash, which
+// depend on every bit of the observation.
+size_t SearchTree::chanceSlot(const SearchNode &node, unsigned int ob) const {
+	unsigned int mask = node.m_capacity - 1;
+	unsigned int i = (ob * 0x9E3779B1u) >> (32 - __builtin_ctz(node.m_capacity));
+	while (m_slots[node.m_slots + i].node && m_slots[node.m_slots + i].key != ob) {
+		i = (i + 1) & mask;
+	}
+	return node.m_slots + i;
+}
+
+// give a node a fresh run of child slots
+void SearchTree::allocSlots(search_index_t idx, unsigned int capacity) {
+	Slot empty = { 0, 0 };
+	m_nodes[idx].m_slots = m_slots.size();
+	m_nodes[idx].m_capacity = capacity;
+	m_slots.resize(m_slots.size() + capacity, empty);
+}
+
+// the child of a node for an action or observation, creating it if need be
+search_index_t SearchTree::addChild(search_index_t idx, unsigned int aor) {
+	SearchNode &node = m_nodes[idx];
+	if (node.m_capacity == 0) {
+		allocSlots(idx, node.m_chance_node ? ChanceSlots : m_actions);
+	}
+
+	size_t slot;
+	if (!m_nodes[idx].m_chance_node) {
+		slot = m_nodes[idx].m_slots + aor;
+	} else {
+		slot = chanceSlot(m_nodes[idx], aor);
+		if (!m_slots[slot].node && 4 * (m_nodes[idx].m_children + 1) > 3 * m_nodes[idx].m_capacity) {
+			// move the table to a run twice the size
+			size_t old_slots = m_nodes[idx].m_slots;
+			unsigned int old_capacity = m_nodes[idx].m_capacity;
+			allocSlots(idx, 2 * old_capacity);
+			for (size_t i = old_slots; i < old_slots + old_capacity; i++) {
+				if (m_slots[i].node) m_slots[chanceSlot(m_nodes[idx], m_slots[i].key)] = m_slots[i];
+			}
+			slot = chanceSlot(m_nodes[idx], aor);
+		}
 	}
-	return &(it->second);
+	if (m_slots[slot].node) return m_slots[slot].node;
+
+	// a decision node's children are chance nodes and the other way around
+	search_index_t child = search_index_t(m_nodes.size());
+	m_nodes.push_back(SearchNode(!m_nodes[idx].m_chance_node));
+	m_slots[slot].key = aor;
+	m_slots[slot].node = child;
+	m_nodes[idx].m_children++;
+	return child;
+}
+
+// generate a percept at a chance node from its trie, working out the
+// probabilities it is missing, and update the agent's model with it if
+// asked to
+void SearchTree::genPercept(Agent &agent, search_index_t idx, bool update,
+	percept_t *observation, percept_t *reward) {
+
+	const size_t bits = agent.perceptBits();
+	size_t applied = 0;	// bits the model has been updated with
+	m_percept.clear();
+
+	if (!m_nodes[idx].m_percept) {
+		m_nodes[idx].m_percept = addPerceptBit(agent.perceptBitProbability(0));
+	}
+	unsigned int t = m_nodes[idx].m_percept;
+	for (size_t i = 0; ; i++) {
+		// draw each bit just as Agent::genPerceptAndUpdate() does
+		symbol_t sym = rand01() < m_percept_trie[t].one;
+		m_percept.push_back(sym);
+		if (i + 1 == bits) break;
+
+		if (!m_percept_trie[t].next[sym]) {
+			// the next bit's probability needs the model to have the bits so far
+			agent.modelUpdatePercept(m_percept, applied, i + 1);
+			applied = i + 1;
+			unsigned int next = addPerceptBit(agent.perceptBitProbability(i + 1));
+			m_percept_trie[t].next[sym] = next;
+		}
+		t = m_percept_trie[t].next[sym];
+	}
+
+	if (update) agent.modelUpdatePercept(m_percept, applied, bits);
+	agent.decodePercept(m_percept, observation, reward);
+}
+
+// add a node to the percept tries
+unsigned int SearchTree::addPerceptBit(double one) {
+	PerceptBit bit = { one, { 0, 0 } };
+	m_percept_trie.push_back(bit);
+	return static_cast<unsigned int>(m_percept_trie.size() - 1);
 }
 
 // determine the next action to play
-action_t SearchNode::selectAction(Agent &agent) const {
+action_t SearchTree::selectAction(Agent &agent, search_index_t idx) {
 	// req: a search tree \Psi
 	// req: a history h
 	// req: an exploration/exploitation constant C
@@ -152,98 +459,318 @@ action_t SearchNode::selectAction(Agent &agent) const {
 	// indexed by actions. We iterate through them to find the ones which have
 	// not been expanded (or somehow expanded but not visited).
 	const double norm_factor = double(agent.horizon() * agent.maxReward());
-	double unexplored_score = -1.0;
 	double explored_score = -1.0;
-	action_t best_action = NULL;
-	int num_actions = agent.numActions();
-	action_t *unexplored = new action_t[num_actions];
-	action_t *best = new action_t[num_actions];
-	int unexploredactions = 0;
-	int bestactions = 0;
-	
-	for (action_t a = 0; a < num_actions; a++) {
-		const SearchNode *ha = child(a);
-		if (NULL == ha || ha->visits() == 0) {
+	action_t best_action = 0;
+	m_unexplored.clear();
+	m_best.clear();
+
+	for (action_t a = 0; a < m_actions; a++) {
+		search_index_t ha = findChild(idx, a);
+		if (!ha || m_nodes[ha].visits() == 0) {
 			// unexplored
-			unexplored[unexploredactions] = a;
-			unexploredactions++;
-		} 
+			m_unexplored.push_back(a);
+		}
 	}
-	
-	if (unexploredactions != 0){
+
+	if (!m_unexplored.empty()) {
 		// choose from one of the unexplored actions
-		best_action = unexplored[randRange(0, unexploredactions)];	
+		best_action = m_unexplored[randRange(0, int(m_unexplored.size()))];
 	}
 	else { // All actions have been explored
 		//Pick the best action but also break ties
-		for (action_t a = 0; a < num_actions; a++) {
-			const SearchNode *ha = child(a);
-			double win_value = ha->expectation() / norm_factor;
-			double ucb_bound = C * sqrt(log(visits()) / ha->visits());
+		const double log_visits = log(double(m_nodes[idx].visits()));
+		for (action_t a = 0; a < m_actions; a++) {
+			const SearchNode &ha = m_nodes[findChild(idx, a)];
+			double win_value = ha.expectation() / norm_factor;
+			double ucb_bound = C * sqrt(log_visits / ha.visits());
 			double score = win_value + ucb_bound;
 			if (score > explored_score) {
 				explored_score = score;
-				bestactions = 0;
-				best[bestactions] = a;
+				m_best.clear();
+				m_best.push_back(a);
 			} else if (score == explored_score) {
-				bestactions++;
-				best[bestactions] = a;
+				m_best.push_back(a);
 			}
 		}
-		if (bestactions > 0) {
-			best_action = best[randRange(0, bestactions+1)];
+		if (m_best.size() > 1) {
+			best_action = m_best[randRange(0, int(m_best.size()))];
 		} else {
-			best_action = best[0];
+			best_action = m_best[0];
 		}
 	}
 
-	delete[] unexplored;
-	delete[] best;
-
 	return best_action;
 }
 
-// perform a sample run through this node and it's children,
+// perform a sample run through a node and its children,
 // returning the accumulated reward from this sample run
-reward_t SearchNode::sample(Agent &agent, unsigned int dfr) { 
-  
+reward_t SearchTree::sample(Agent &agent, search_index_t idx, unsigned int dfr, bool cached) {
+
 	// req: a search tree \Psi (in agent)
 	// req: a history h (also in agent)
 	// req: a remaining search horizon m (dfr)
 	reward_t reward;
 	if (dfr == 0) {
 		return reward_t(0.0);
-	} else if (m_chance_node) { // Is this set properly?
+	} else if (m_nodes[idx].m_chance_node) {
 		// chance node business
 		// Generates (o,r) from the ctw given h
 		percept_t ob, r;
-		// generate observation and reward, and update ctw/history
-		agent.genPerceptAndUpdate(&ob, &r);
+		// generate observation and reward, and update ctw/history, from the
+		// cache only if the search goes on below
+		if (cached) {
+			genPercept(agent, idx, dfr > 1, &ob, &r);
+		} else {
+			agent.genPerceptAndUpdate(&ob, &r);
+		}
 		// Create node \Psi(hor) if T(hor) = 0, i.e. it doesn't exist
-		if (child(ob) == NULL) {
-			m_child[ob] = new SearchNode(false);
-			// Necessary for some reason, otherwise child SearchNode will be a chance node
-			m_child[ob].m_chance_node = false;
+		size_t nodes = m_nodes.size();
+		search_index_t child = addChild(idx, ob);
+		if (m_nodes.size() > nodes) {
+			m_nodes[child].m_percept = r;
+		} else {
+			cached = cached && m_nodes[child].m_percept == r;
 		}
-		reward = r + m_child[ob].sample(agent, dfr - 1);
-	} else if (m_visits == 0) {
+		reward = r + sample(agent, child, dfr - 1, cached);
+	} else if (m_nodes[idx].m_visits == 0) {
 		reward = playout(agent, dfr);
 	} else {
 		// not a chance node, pick a maximising action
-		action_t a = selectAction(agent);
+		action_t a = selectAction(agent, idx);
 		// update the model
 		agent.modelUpdate(a);
-		if (child(a) == NULL) {
-			m_child[a] = new SearchNode(true);
-			m_child[a].m_chance_node = true;
-		}
-		reward = m_child[a].sample(agent, dfr);
+		search_index_t child = addChild(idx, a);
+		reward = sample(agent, child, dfr, cached);
 	}
 
 	// Back propagation:
-	m_mean = (reward + double(m_visits)*m_mean) / (double(m_visits) + 1.0);
-	m_visits++;
+	SearchNode &node = m_nodes[idx];
+	node.m_mean = (reward + double(node.m_visits)*node.m_mean) / (double(node.m_visits) + 1.0);
+	node.m_visits++;
 
 	// Return reward
 	return reward;
 }
+
+
+SharedSearchNode::SharedSearchNode(bool chance, unsigned int key) :
+	m_chance_node(chance),
+	m_key(key),
+	m_first_child(0),
+	m_sibling(0),
+	m_total(0.0),
+	m_visits(0),
+	m_virtual(0)
+{
+}
+
+// the mean reward of the visits backed up so far
+reward_t SharedSearchNode::expectation(void) const {
+	visits_t visits = this->visits();
+	double total;
+	__atomic_load(&m_total, &total, __ATOMIC_RELAXED);
+	return visits == 0 ? 0.0 : total / double(visits);
+}
+
+
+SharedSearchTree::SharedSearchTree(void) :
+	m_actions(0),
+	m_age(0),
+	m_simulations(0),
+	m_size(0)
+{
+}
+
+// drop every node, leaving a fresh root
+void SharedSearchTree::reset(unsigned int actions, int simulations) {
+	m_actions = actions;
+	// a simulation adds at most a chance node and a decision node, see
+	// sample(); should the threads waste some racing for the same child,
+	// the last simulations just expand less
+	m_nodes.assign(2 * size_t(simulations) + 1, SharedSearchNode());
+	m_size = 1;
+}
+
+// make the decision node an action and observation lead to the new root
+bool SharedSearchTree::advance(action_t action, percept_t observation, int simulations) {
+	search_index_t chance = findChild(0, action);
+	search_index_t idx = chance ? findChild(chance, observation) : 0;
+	if (!idx) return false;
+
+	// copy the subtree over depth first, numbering it from 0, with every
+	// list of children kept in order
+	m_spare_nodes.clear();
+	m_spare_nodes.push_back(m_nodes[idx]);
+	m_spare_nodes[0].m_sibling = 0;
+	m_copy_stack.push_back(std::make_pair(idx, search_index_t(0)));
+	while (!m_copy_stack.empty()) {
+		search_index_t from = m_copy_stack.back().first;
+		search_index_t to = m_copy_stack.back().second;
+		m_copy_stack.pop_back();
+
+		search_index_t last = 0;
+		for (search_index_t c = m_nodes[from].m_first_child; c; c = m_nodes[c].m_sibling) {
+			search_index_t copy = search_index_t(m_spare_nodes.size());
+			m_spare_nodes.push_back(m_nodes[c]);
+			if (last) {
+				m_spare_nodes[last].m_sibling = copy;
+			} else {
+				m_spare_nodes[to].m_first_child = copy;
+			}
+			m_copy_stack.push_back(std::make_pair(c, copy));
+			last = copy;
+		}
+	}
+
+	m_size = search_index_t(m_spare_nodes.size());
+	m_spare_nodes.resize(m_spare_nodes.size() + 2 * size_t(simulations), SharedSearchNode());
+	m_nodes.swap(m_spare_nodes);
+	return true;
+}
+
+// perform a sample run from the root
+reward_t SharedSearchTree::sample(Agent &agent, Scratch &scratch) {
+	return sample(agent, scratch, 0, agent.horizon());
+}
+
+// return pointer to child corresponding to action/percept
+const SharedSearchNode *SharedSearchTree::child(const SharedSearchNode &node, unsigned int aor) const {
+	search_index_t idx = findChild(search_index_t(&node - &m_nodes[0]), aor);
+	return idx ? &m_nodes[idx] : NULL;
+}
+
+// the child of a node for an action or observation, 0 if there is none
+search_index_t SharedSearchTree::findChild(search_index_t idx, unsigned int aor) const {
+	search_index_t c = __atomic_load_n(&m_nodes[idx].m_first_child, __ATOMIC_ACQUIRE);
+	while (c && m_nodes[c].m_key != aor) c = m_nodes[c].m_sibling;
+	return c;
+}
+
+// the child of a node for an action or observation, creating it if need be
+search_index_t SharedSearchTree::addChild(search_index_t idx, unsigned int aor) {
+	search_index_t &first = m_nodes[idx].m_first_child;
+	search_index_t head = __atomic_load_n(&first, __ATOMIC_ACQUIRE);
+	search_index_t seen = 0;	// the part of the list already searched
+	search_index_t child = 0;
+	for (;;) {
+		for (search_index_t c = head; c != seen; c = m_nodes[c].m_sibling) {
+			if (m_nodes[c].m_key == aor) return c;
+		}
+		seen = head;
+
+		if (!child) {
+			child = __atomic_fetch_add(&m_size, 1, __ATOMIC_RELAXED);
+			if (child >= m_nodes.size()) return 0;
+			// a decision node's children are chance nodes and the other way around
+			m_nodes[child] = SharedSearchNode(!m_nodes[idx].m_chance_node, aor);
+		}
+		m_nodes[child].m_sibling = head;
+
+		// on failure head is reloaded, and only the children pushed on
+		// since need checking
+		if (__atomic_compare_exchange_n(&first, &head, child, false,
+				__ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+			return child;
+		}
+	}
+}
+
+// determine the next action to play, counting the samples under way below
+// the children as visits with no reward
+action_t SharedSearchTree::selectAction(Agent &agent, Scratch &scratch, search_index_t idx) {
+	const double norm_factor = double(agent.horizon() * agent.maxReward());
+	double explored_score = -1.0;
+	scratch.children.assign(m_actions, 0);
+	scratch.unexplored.clear();
+	scratch.best.clear();
+
+	for (search_index_t c = __atomic_load_n(&m_nodes[idx].m_first_child, __ATOMIC_ACQUIRE); c; c = m_nodes[c].m_sibling) {
+		scratch.children[m_nodes[c].m_key] = c;
+	}
+
+	visits_t total_visits = 0;
+	for (action_t a = 0; a < m_actions; a++) {
+		search_index_t ha = scratch.children[a];
+		visits_t visits = ha ? m_nodes[ha].visits() + __atomic_load_n(&m_nodes[ha].m_virtual, __ATOMIC_RELAXED) : 0;
+		if (visits == 0) {
+			// unexplored, and no other thread is trying it either
+			scratch.unexplored.push_back(a);
+		}
+		total_visits += visits;
+	}
+
+	if (!scratch.unexplored.empty()) {
+		// choose from one of the unexplored actions
+		return scratch.unexplored[randRange(0, int(scratch.unexplored.size()))];
+	}
+
+	// All actions have been explored, pick the best action but also break
+	// ties
+	const double log_visits = log(double(total_visits));
+	for (action_t a = 0; a < m_actions; a++) {
+		const SharedSearchNode &ha = m_nodes[scratch.children[a]];
+		double visits = double(ha.visits() + __atomic_load_n(&ha.m_virtual, __ATOMIC_RELAXED));
+		double total;
+		__atomic_load(&ha.m_total, &total, __ATOMIC_RELAXED);
+		double win_value = total / visits / norm_factor;
+		double ucb_bound = C * sqrt(log_visits / visits);
+		double score = win_value + ucb_bound;
+		if (score > explored_score) {
+			explored_score = score;
+			scratch.best.clear();
+			scratch.best.push_back(a);
+		} else if (score == explored_score) {
+			scratch.best.push_back(a);
+		}
+	}
+	if (scratch.best.size() > 1) {
+		return scratch.best[randRange(0, int(scratch.best.size()))];
+	}
+	return scratch.best[0];
+}
+
+// perform a sample run through a node and its children
+reward_t SharedSearchTree::sample(Agent &agent, Scratch &scratch, search_index_t idx, unsigned int dfr) {
+	if (dfr == 0) {
+		return reward_t(0.0);
+	}
+
+	SharedSearchNode &node = m_nodes[idx];
+	__atomic_fetch_add(&node.m_virtual, 1, __ATOMIC_RELAXED);
+
+	reward_t reward;
+	if (node.m_chance_node) {
+		// generate observation and reward, and update ctw/history
+		percept_t ob, r;
+		agent.genPerceptAndUpdate(&ob, &r);
+		search_index_t child = addChild(idx, ob);
+		reward = r + (child ? sample(agent, scratch, child, dfr - 1) : playout(agent, dfr - 1));
+	} else if (node.visits() == 0) {
+		reward = playout(agent, dfr);
+	} else {
+		// not a chance node, pick a maximising action
+		action_t a = selectAction(agent, scratch, idx);
+		agent.modelUpdate(a);
+		search_index_t child = addChild(idx, a);
+		if (child) {
+			reward = sample(agent, scratch, child, dfr);
+		} else {
+			// the tree is full, play the rest out from the chance node
+			percept_t ob, r;
+			agent.genPerceptAndUpdate(&ob, &r);
+			reward = r + playout(agent, dfr - 1);
+		}
+	}
+
+	// Back propagation, turning the virtual loss into a real visit
+	double total, sum;
+	__atomic_load(&node.m_total, &total, __ATOMIC_RELAXED);
+	do {
+		sum = total + reward;
+	} while (!__atomic_compare_exchange(&node.m_total, &total, &sum, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_fetch_add(&node.m_visits, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&node.m_virtual, 1, __ATOMIC_RELAXED);
+
+	return reward;
+}
@@ -1,11 +1,310 @@
 #ifndef __SEARCH_HPP__
 #define __SEARCH_HPP__
 
+#include <utility>
+#include <vector>
+
 #include "main.hpp"
 
 class Agent;
+class WorkerPool;
+
+typedef unsigned long long visits_t;
+
+// index of a node in a SearchTree. The root is node 0, and as nothing links
+// to it 0 doubles as the "no child" marker.
+typedef unsigned int search_index_t;
+
+// contains information about a single "state"
+class SearchNode {
+	friend class SearchTree;
+
+public:
+	// determine the expected reward from this node
+	reward_t expectation(void) const { return m_mean; }
+	// XXX: this is ridiculous, what is the damn point of typedef-ing this
+	// stuff if you aren't even going to stick to your own definitions?
+
+	// number of times the search node has been visited
+	visits_t visits(void) const { return m_visits; }
+
+	// true if this node is a chance node, false otherwise
+	bool isChanceNode(void) const { return m_chance_node; }
+
+private:
+	SearchNode(bool is_chance_node);
+
+	bool m_chance_node; // true if this node is a chance node, false otherwise
+	// a chance node's percept trie, 0 until first sampled, or the reward a
+	// decision node was first reached with, see SearchTree
+	unsigned int m_percept;
+	double m_mean;	  // the expected reward of this node
+	visits_t m_visits;  // number of times the search node has been visited
+
+	// the node's child slots in the tree's slot array, none until it is
+	// first expanded, and for a chance node how many of them are in use
+	size_t m_slots;
+	unsigned int m_capacity;
+	unsigned int m_children;
+};
+
+// A search tree held in two flat arrays that are emptied, not freed, by
+// reset(), so that once they have grown to the size of a search no further
+// allocation takes place. A decision node's children sit in a dense run of
+// slots indexed by action. A chance node's sit in a small open-addressing
+// table keyed by observation, which moves to a run twice the size at the
+// end of the slot array when it gets three quarters full; the run it
+// leaves behind is reclaimed by the next reset() or advance().
+//
+// Decision nodes are keyed by observation alone, but when a sample reaches
+// one with the reward it was first reached with, and so on up to the root,
+// the model is in the same state at the chance nodes below as on every such
+// sample. Those chance nodes cache the probabilities the percepts they
+// generate are drawn with, bit by bit in a trie that only grows along the
+// prefixes actually drawn. The model is then only updated with a percept
+// when the search goes on below it, or with a prefix when the probability
+// of the bit after it is yet to be worked out. Other samples generate their
+// percepts from the model as usual.
+//
+// A tree can be kept from one agent cycle to the next, see search().
+class SearchTree {
+public:
+	typedef SearchNode node_type;
+
+	SearchTree(void);
+
+	// drop every node, leaving a fresh decision node as the root, and make
+	// room for a search of the given number of simulations
+	void reset(unsigned int actions, int simulations);
+
+	// make the decision node an action and observation lead to from the
+	// root the new root, releasing the rest of the tree, and make room for
+	// a search of the given number of simulations. False, leaving the tree
+	// as it was, if there is no such node.
+	bool advance(action_t action, percept_t observation, int simulations);
+
+	// the agent age the tree was last searched at, and the number of
+	// simulations that search ran, see search()
+	age_t age(void) const { return m_age; }
+	void setAge(age_t age) { m_age = age; }
+	int simulations(void) const { return m_simulations; }
+	void setSimulations(int simulations) { m_simulations = simulations; }
+
+	// whether the tree holds any nodes at all, and drop them all so that
+	// the next search starts over
+	bool empty(void) const { return m_nodes.empty(); }
+	void clear(void) { m_nodes.clear(); m_slots.clear(); }
+
+	// the root, and the child of a node for an action or observation, NULL
+	// if there is none
+	const SearchNode &root(void) const { return m_nodes[0]; }
+	const SearchNode *child(const SearchNode &node, unsigned int aor) const;
+
+	// perform a sample run from the root, returning the accumulated reward
+	// of this sample run
+	reward_t sample(Agent &agent);
+
+private:
+	// a child slot: the action or observation it is for, and the child
+	struct Slot {
+		unsigned int key;
+		search_index_t node;
+	};
+
+	// a node of a percept trie: the probability that the next percept bit
+	// is a 1 after the prefix leading here, and the node after each value
+	// of it, 0 until that probability is needed
+	struct PerceptBit {
+		double one;
+		unsigned int next[2];
+	};
+
+	// perform a sample run through a node and its children, returning the
+	// accumulated reward from this sample run. Cached says whether the
+	// chance nodes' percept tries fit the model on the way.
+	reward_t sample(Agent &agent, search_index_t idx, unsigned int dfr, bool cached);
+
+	// determine the next action to play from a decision node
+	action_t selectAction(Agent &agent, search_index_t idx);
+
+	// the child of a node for an action or observation, 0 if there is none,
+	// and one that creates the child if need be
+	search_index_t findChild(search_index_t idx, unsigned int aor) const;
+	search_index_t addChild(search_index_t idx, unsigned int aor);
+
+	// the slot of a chance node's table that holds an observation, or the
+	// empty one it would go in
+	size_t chanceSlot(const SearchNode &node, unsigned int ob) const;
+
+	// give a node a fresh run of child slots of the given size
+	void allocSlots(search_index_t idx, unsigned int capacity);
+
+	// generate a percept at a chance node from its trie, updating the
+	// agent's model with it if asked to, and add a node to the trie
+	void genPercept(Agent &agent, search_index_t idx, bool update, percept_t *observation, percept_t *reward);
+	unsigned int addPerceptBit(double one);
+
+	// make room for a search of the given number of simulations
+	void reserve(int simulations);
+
+	static const unsigned int ChanceSlots = 4; // initial chance node table size
+
+	unsigned int m_actions;
+	age_t m_age;
+	int m_simulations;
+	std::vector<SearchNode> m_nodes;
+	std::vector<Slot> m_slots;
 
-// determine the best action by searching ahead
+	// the chance nodes' percept tries, whose node 0 stands for none, and
+	// the percept genPercept() is drawing
+	std::vector<PerceptBit> m_percept_trie;
+	symbol_list_t m_percept;
+
+	// advance() copies the part of the tree it keeps into these, and swaps
+	// them with the arrays above. Its stack of old and new node indices.
+	std::vector<SearchNode> m_spare_nodes;
+	std::vector<Slot> m_spare_slots;
+	std::vector<std::pair<search_index_t, search_index_t> > m_copy_stack;
+
+	// selectAction()'s candidate actions, kept to save reallocating them
+	std::vector<action_t> m_unexplored;
+	std::vector<action_t> m_best;
+};
+
+// a node of a SharedSearchTree, whose statistics can be read while other
+// threads are updating them
+class SharedSearchNode {
+	friend class SharedSearchTree;
+
+public:
+	// the mean reward of the visits backed up so far
+	reward_t expectation(void) const;
+
+	// number of times the search node has been visited
+	visits_t visits(void) const { return __atomic_load_n(&m_visits, __ATOMIC_RELAXED); }
+
+	// true if this node is a chance node, false otherwise
+	bool isChanceNode(void) const { return m_chance_node; }
+
+private:
+	SharedSearchNode(bool is_chance_node = false, unsigned int key = 0);
+
+	bool m_chance_node;
+	unsigned int m_key;	// the action or observation leading to the node
+
+	// the first child and the next sibling, fixed once the node is linked
+	// in, apart from new children being pushed on the front
+	search_index_t m_first_child;
+	search_index_t m_sibling;
+
+	// updated atomically
+	double m_total;		// the sum of the rewards backed up through the node
+	visits_t m_visits;
+	visits_t m_virtual;	// samples under way below the node, each a virtual loss
+};
+
+// A search tree sampled by several threads at once, for tree-parallel
+// search. The nodes sit in one array sized for the whole search up front,
+// so that it never moves, and are handed out by an atomic counter. A
+// node's children form a list that new ones are pushed onto with a compare
+// and swap, so that expanding the tree takes no locks, and the statistics
+// are kept with atomic operations. Every sample counts as a visit with no
+// reward, a virtual loss, to the nodes it passes until it backs up its
+// real reward, which steers the other threads onto other paths meanwhile.
+//
+// The tree is kept between cycles like SearchTree, which the interface
+// follows.
+class SharedSearchTree {
+public:
+	typedef SharedSearchNode node_type;
+
+	// a sampling thread's own working space
+	struct Scratch {
+		std::vector<search_index_t> children;
+		std::vector<action_t> unexplored;
+		std::vector<action_t> best;
+	};
+
+	SharedSearchTree(void);
+
+	// drop every node, leaving a fresh decision node as the root, and make
+	// room for a search of the given number of simulations
+	void reset(unsigned int actions, int simulations);
+
+	// make the decision node an action and observation lead to from the
+	// root the new root, as SearchTree does. Not to be called during a
+	// search.
+	bool advance(action_t action, percept_t observation, int simulations);
+
+	// the agent age the tree was last searched at, and the number of
+	// simulations that search ran
+	age_t age(void) const { return m_age; }
+	void setAge(age_t age) { m_age = age; }
+	int simulations(void) const { return m_simulations; }
+	void setSimulations(int simulations) { m_simulations = simulations; }
+
+	// whether the tree holds any nodes at all, and drop them all
+	bool empty(void) const { return m_nodes.empty(); }
+	void clear(void) { m_nodes.clear(); m_size = 0; }
+
+	// the root, and the child of a node for an action or observation, NULL
+	// if there is none
+	const SharedSearchNode &root(void) const { return m_nodes[0]; }
+	const SharedSearchNode *child(const SharedSearchNode &node, unsigned int aor) const;
+
+	// perform a sample run from the root with an agent of the thread's own,
+	// returning the accumulated reward of this sample run. Safe to call
+	// from several threads at once.
+	reward_t sample(Agent &agent, Scratch &scratch);
+
+private:
+	// perform a sample run through a node and its children
+	reward_t sample(Agent &agent, Scratch &scratch, search_index_t idx, unsigned int dfr);
+
+	// determine the next action to play from a decision node
+	action_t selectAction(Agent &agent, Scratch &scratch, search_index_t idx);
+
+	// the child of a node for an action or observation, 0 if there is none,
+	// and one that creates the child if need be, 0 if the tree is full
+	search_index_t findChild(search_index_t idx, unsigned int aor) const;
+	search_index_t addChild(search_index_t idx, unsigned int aor);
+
+	unsigned int m_actions;
+	age_t m_age;
+	int m_simulations;
+	std::vector<SharedSearchNode> m_nodes;
+	search_index_t m_size;	// nodes handed out, atomically, may overshoot
+
+	// advance() copies the part of the tree it keeps into these, and swaps
+	// them with the array above. Its stack of old and new node indices.
+	std::vector<SharedSearchNode> m_spare_nodes;
+	std::vector<std::pair<search_index_t, search_index_t> > m_copy_stack;
+};
+
+// determine the best action by searching ahead, in a fresh tree. The
+// search runs the agent's number of simulations, or if it has a search
+// time, as many as fit in it: the clock is read only every so many
+// simulations, as many as the rate so far says take a 32nd of the budget,
+// so a search overruns it by about that much at most. At least one
+// simulation is always run.
 extern action_t search(Agent &agent);
 
+// the same in a tree kept between calls. If the tree was last searched one
+// cycle ago, the subtree under the action the agent took and the
+// observation it received since is searched on rather than starting over.
+extern action_t search(Agent &agent, SearchTree &tree);
+
+// the same, root-parallel: every tree is searched on a thread of the pool,
+// each against its own SharedView of the agent, see Agent, with an equal
+// share of the simulations or all of the search time, and the action is
+// chosen from the statistics of the root's children summed over the trees.
+// Each tree is kept between calls as above.
+extern action_t search(Agent &agent, std::vector<SearchTree> &trees, WorkerPool &pool);
+
+// the same, tree-parallel: every thread of the pool samples the one shared
+// tree, against its own SharedView of the agent, until the simulations
+// have all been claimed or the search time is up. The tree is kept between
+// calls as above.
+extern action_t search(Agent &agent, SharedSearchTree &tree, WorkerPool &pool);
+
 #endif // __SEARCH_HPP__
@@ -3,6 +3,7 @@
 #include "util.hpp"
 #include "environment.hpp"
 #include "agent.hpp"
+#include "pool.hpp"
 
 #include <string>
 #include <stdlib.h>
@@ -31,31 +32,96 @@ int main(int argc, char *argv[]) {
 	// Load configuration options
 	// Default configuration values
 	options["ct-depth"] = "4";
+	options["ct-node-format"] = "standard";
+	options["ct-factored"] = "false";	// "true" gives each percept bit its own tree
+	options["ct-threads"] = "1";	// threads to update factored trees on
+	options["ct-max-nodes"] = "0";	// node budget, 0 for no limit
+	options["ct-lazy-weights"] = "false";	// "true" updates weights without reading siblings
 	options["agent-horizon"] = "16";
 	options["exploration"] = "0";	 // do not explore
 	options["explore-decay"] = "1.0"; // exploration rate does not decay
 	options["mc-simulations"] = "32";
+	options["search-time-ms"] = "0";	// search a fixed number of simulations
 	options["agent-actions"] = "2";
 	options["observation-bits"] = "1";
 	options["reward-bits"] = "1";
 	
 	Agent ai(options);
+	// the agent always starts out with a percept
+	ai.modelUpdate(0, 0);
 	simulate_coinflips(ai,2000);
 	std::cout << "After 2000 flips:" << std::endl;
 	std::cout << ai.prettyPrintContextTree();
 	
-	ModelUndo mu = ModelUndo(ai);
-	for (int i = 0; i < 5; i++) {
-		simulate_coinflips(ai,5);
-		ai.modelRevert(mu);
-		std::cout << "after revert #" << (i+1) << std::endl;
-		std::cout << ai.prettyPrintContextTree();
+	std::string before = ai.prettyPrintContextTree();
+	{
+		ModelUndo mu(ai);
+		for (int i = 0; i < 5; i++) {
+			simulate_coinflips(ai,5);
+			ai.modelRevert(mu);
+			std::cout << "after revert #" << (i+1) << std::endl;
+			std::cout << ai.prettyPrintContextTree();
+			assert(ai.prettyPrintContextTree() == before);
+		}
 	}
 	std::cout << "after reverts" << std::endl;
 	std::cout << ai.prettyPrintContextTree();
 
+	// generating a percept a bit at a time, as the search's chance nodes
+	// do, draws the same percept as generating it in one go
+	{
+		ModelUndo mu(ai);
+		ai.modelUpdate(action_t(1));
+		ModelUndo after_action(ai);
+		percept_t ob1, r1, ob2, r2;
+		srand(5);
+		ai.genPerceptAndUpdate(&ob1, &r1);
+		ai.modelRevert(after_action);
+		srand(5);
+		symbol_list_t percept;
+		for (size_t i = 0; i < ai.perceptBits(); i++) {
+			percept.push_back(rand01() < ai.perceptBitProbability(i));
+			ai.modelUpdatePercept(percept, i, i + 1);
+		}
+		ai.decodePercept(percept, &ob2, &r2);
+		assert(ob1 == ob2 && r1 == r2);
+		ai.modelRevert(mu);
+	}
+
 	std::cout << "Agent history: " << std::endl;
 	std::cout << ai.printHistory() << std::endl;
 	std::cout << "Next action: " << search(ai) << std::endl;
+
+	// a tree kept between cycles searches on under the action taken and
+	// the observation received
+	SearchTree tree;
+	action_t action = search(ai, tree);
+	assert(tree.root().visits() == visits_t(ai.numSimulations()));
+	ai.modelUpdate(action);
+	ai.modelUpdate(1, 1);
+	search(ai, tree);
+	std::cout << "Reused search tree root visits: " << tree.root().visits() << std::endl;
+	assert(tree.root().visits() > visits_t(ai.numSimulations()));
+
+	// a root-parallel search shares the simulations out between its trees,
+	// and leaves the agent as it found it
+	std::vector<SearchTree> trees(3);
+	WorkerPool pool(3);
+	std::string model = ai.prettyPrintContextTree();
+	action = search(ai, trees, pool);
+	assert(action < ai.numActions());
+	assert(ai.prettyPrintContextTree() == model);
+	visits_t visits = 0;
+	for (size_t i = 0; i < trees.size(); i++) visits += trees[i].root().visits();
+	std::cout << "Root-parallel search action: " << action << std::endl;
+	assert(visits == visits_t(ai.numSimulations()));
+
+	// so does a tree-parallel one, with every simulation in the one tree
+	SharedSearchTree shared;
+	action = search(ai, shared, pool);
+	assert(action < ai.numActions());
+	assert(ai.prettyPrintContextTree() == model);
+	std::cout << "Tree-parallel search action: " << action << std::endl;
+	assert(shared.root().visits() == visits_t(ai.numSimulations()));
 	
 }
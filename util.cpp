@@ -2,11 +2,38 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <ctime>
 
 
+// the calling thread's own generator state, 0 while it uses rand()
+static __thread unsigned long long t_random_state = 0;
+
+// Switch the calling thread over to a generator of its own
+void seedThreadRandom(unsigned int seed) {
+	t_random_state = (seed + 1ULL) * 0x9E3779B97F4A7C15ULL;
+	if (t_random_state == 0) t_random_state = 1;
+}
+
+// Switch the calling thread back to rand()
+void releaseThreadRandom(void) {
+	t_random_state = 0;
+}
+
+// the next number from the calling thread's generator, a xorshift64* for
+// threads that have their own, between [0, RAND_MAX] like rand()
+static int nextRandom(void) {
+	if (t_random_state == 0) return rand();
+
+	t_random_state ^= t_random_state >> 12;
+	t_random_state ^= t_random_state << 25;
+	t_random_state ^= t_random_state >> 27;
+	unsigned long long r = (t_random_state * 0x2545F4914F6CDD1DULL) >> 32;
+	return int(r % ((unsigned long long)RAND_MAX + 1));
+}
+
 // Return a random number uniformly distributed in [0, 1]
 double rand01() {
-	return (double)rand() / (double)RAND_MAX;
+	return (double)nextRandom() / (double)RAND_MAX;
 }
 
 // Return a random integer between [0, end)
@@ -14,9 +41,9 @@ unsigned int randRange(unsigned int end) {
 	assert(end <= RAND_MAX);
 
 	// Generate an integer between [0, end) uniformly
-	int r = rand();
+	int r = nextRandom();
 	const int remainder = RAND_MAX % end;
-	while (r < remainder) r = rand();
+	while (r < remainder) r = nextRandom();
 	return r % end;
 }
 
@@ -27,6 +54,14 @@ int randRange(int start, int end) {
 }
 
 
+// Seconds on a monotonic clock
+double clockSeconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+}
+
+
 // Decodes the value encoded on the end of a list of symbols
 unsigned int decode(const symbol_list_t &symlist, unsigned int bits) {
 	assert(bits <= symlist.size());
@@ -8,6 +8,14 @@
 
 #include "main.hpp"
 
+// Switch the calling thread over to a random number generator of its own,
+// seeded with seed, so that threads can sample concurrently and
+// reproducibly. Threads that never call this share the one behind rand().
+void seedThreadRandom(unsigned int seed);
+
+// Switch the calling thread back to rand()
+void releaseThreadRandom(void);
+
 // Return a number uniformly between [0, 1]
 double rand01();
 
@@ -17,6 +25,9 @@ unsigned int randRange(unsigned int end);
 // Return a random number between [start, end)
 int randRange(int start, int end);
 
+// Seconds on a monotonic clock, for measuring intervals
+double clockSeconds(void);
+
 // Extract a value from a string
 template <typename T>
 void strExtract(std::string &str, T &val) {